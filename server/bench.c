@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "game.h"
+#include "protocol.h"
+#include "room.h"
+
+#define BENCH_SEED 2137
+#define BENCH_MIN_NANOSECONDS 200000000ULL
+#define BENCH_RUNS 5
+#define BENCH_SINK_SIZE 65536
+
+/*
+ * Every mutating benchmark starts each operation from the same pristine
+ * game, so all of them also pay for the copy measured by game_copy.
+ */
+typedef struct
+{
+  const deck_t *deck;
+  deal_t deal;
+  game_t pristine_game;
+  game_t game;
+  room_manager_t room_manager;
+  room_t *room;
+  char sink[BENCH_SINK_SIZE];
+  long long sink_length;
+  volatile int result;
+} bench_context_t;
+
+typedef struct
+{
+  const char *name;
+  void (*run)(bench_context_t *context, long long iterations);
+} benchmark_t;
+
+static long long allocations_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+/*
+ * The bench links with --wrap for the allocator entry points, so every
+ * allocation made by the game and room code is counted here.
+ */
+void *__wrap_malloc(size_t size)
+{
+  allocations_count++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+  allocations_count++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+  allocations_count++;
+  return __real_realloc(pointer, size);
+}
+
+static unsigned long long now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int matching_symbol(game_t *game, int player_id)
+{
+  return common_symbol(game->deck, game->player_states[player_id].current_card_index, game->current_top_card_index);
+}
+
+static int mismatching_symbol(game_t *game, int player_id)
+{
+  const int *symbols = get_card_symbols(game->deck, game->player_states[player_id].current_card_index);
+  int symbol = matching_symbol(game, player_id);
+
+  return symbols[0] == symbol ? symbols[1] : symbols[0];
+}
+
+static void bench_game_copy(bench_context_t *context, long long iterations)
+{
+  for (long long i = 0; i < iterations; i++)
+  {
+    memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+    context->result += context->game.cards_hash;
+  }
+}
+
+static void bench_calculate_board_hash(bench_context_t *context, long long iterations)
+{
+  for (long long i = 0; i < iterations; i++)
+  {
+    context->result += calculate_board_hash(&context->pristine_game);
+  }
+}
+
+static void bench_get_board_hash(bench_context_t *context, long long iterations)
+{
+  for (long long i = 0; i < iterations; i++)
+  {
+    context->result += get_board_hash(&context->pristine_game);
+  }
+}
+
+static void bench_checking_guess_match(bench_context_t *context, long long iterations)
+{
+  action_t action = {CARD, matching_symbol(&context->pristine_game, 0), 0, 0};
+
+  for (long long i = 0; i < iterations; i++)
+  {
+    memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+    context->result += checking_guess(&context->game, &action, 0);
+  }
+}
+
+static void bench_checking_guess_mismatch(bench_context_t *context, long long iterations)
+{
+  action_t action = {CARD, mismatching_symbol(&context->pristine_game, 0), 0, 0};
+
+  for (long long i = 0; i < iterations; i++)
+  {
+    memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+    context->result += checking_guess(&context->game, &action, 0);
+  }
+}
+
+static void bench_act_player(bench_context_t *context, long long iterations, action_t *action)
+{
+  for (long long i = 0; i < iterations; i++)
+  {
+    memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+    context->result += act_player(&context->game, action, 0);
+  }
+}
+
+static void bench_act_player_card(bench_context_t *context, long long iterations)
+{
+  action_t action = {CARD, matching_symbol(&context->pristine_game, 0), 0, 0};
+  bench_act_player(context, iterations, &action);
+}
+
+static void bench_act_player_swap(bench_context_t *context, long long iterations)
+{
+  action_t action = {SWAP, 1, 0, 0};
+  bench_act_player(context, iterations, &action);
+}
+
+static void bench_act_player_freeze(bench_context_t *context, long long iterations)
+{
+  action_t action = {FREEZE, 1, 0, 0};
+  bench_act_player(context, iterations, &action);
+}
+
+static void bench_act_player_reroll(bench_context_t *context, long long iterations)
+{
+  action_t action = {REROLL, 0, 0, 0};
+  bench_act_player(context, iterations, &action);
+}
+
+static void bench_swap_cards(bench_context_t *context, long long iterations)
+{
+  for (long long i = 0; i < iterations; i++)
+  {
+    context->result += swap_cards(&context->game, &context->game.player_states[0], &context->game.player_states[1]);
+  }
+}
+
+static void bench_init_destroy_game(bench_context_t *context, long long iterations)
+{
+  deal_t deal;
+
+  for (long long i = 0; i < iterations; i++)
+  {
+    deal_cards(&deal, context->deck, BENCH_SEED + i);
+    init_game(&context->game, context->deck, &deal, DEFAULT_PLAYERS_PER_ROOM);
+    context->result += context->game.cards_hash;
+    destroy_game(&context->game);
+  }
+  memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+}
+
+/*
+ * Produces the exact bytes send_game_state puts on the wire and copies
+ * them into a memory sink instead of a socket.
+ */
+static void bench_encode_state(bench_context_t *context, long long iterations, int protocol_version, message_buffer_t *message)
+{
+  room_t *room = context->room;
+
+  room->protocol_versions = PROTOCOL_VERSION_BIT(protocol_version);
+  for (long long i = 0; i < iterations; i++)
+  {
+    encode_room_state(room);
+    memcpy(context->sink, message->data, message->length);
+    context->sink_length += message->length;
+  }
+}
+
+static void bench_send_game_state(bench_context_t *context, long long iterations)
+{
+  bench_encode_state(context, iterations, PROTOCOL_VERSION_LEGACY, &context->room->state_message);
+}
+
+static void bench_send_game_state_frame(bench_context_t *context, long long iterations)
+{
+  bench_encode_state(context, iterations, PROTOCOL_VERSION_FRAMED, get_room_state_frame(context->room));
+}
+
+/*
+ * Alternates the room between the pristine game and the game after one
+ * matching guess, so every update has a top card and two seats to diff.
+ */
+static void bench_send_game_delta(bench_context_t *context, long long iterations)
+{
+  room_t *room = context->room;
+  action_t action = {CARD, matching_symbol(&context->pristine_game, 0), 0, 0};
+
+  memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+  act_player(&context->game, &action, 0);
+
+  room->protocol_versions = PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_FRAMED);
+  for (long long i = 0; i < iterations; i++)
+  {
+    memcpy(&room->game, i % 2 == 0 ? &context->game : &context->pristine_game, sizeof(game_t));
+    if (update_room_state(room))
+    {
+      memcpy(context->sink, room->delta_frame.data, room->delta_frame.length);
+      context->sink_length += room->delta_frame.length;
+    }
+  }
+  memcpy(&room->game, &context->pristine_game, sizeof(game_t));
+}
+
+static const benchmark_t benchmarks[] = {
+    {"game_copy", bench_game_copy},
+    {"calculate_board_hash", bench_calculate_board_hash},
+    {"get_board_hash", bench_get_board_hash},
+    {"checking_guess_match", bench_checking_guess_match},
+    {"checking_guess_mismatch", bench_checking_guess_mismatch},
+    {"act_player_card", bench_act_player_card},
+    {"act_player_swap", bench_act_player_swap},
+    {"act_player_freeze", bench_act_player_freeze},
+    {"act_player_reroll", bench_act_player_reroll},
+    {"swap_cards", bench_swap_cards},
+    {"init_destroy_game", bench_init_destroy_game},
+    {"send_game_state", bench_send_game_state},
+    {"send_game_state_frame", bench_send_game_state_frame},
+    {"send_game_delta", bench_send_game_delta},
+};
+
+static void init_bench_context(bench_context_t *context, int symbols_per_card)
+{
+  context->deck = get_deck(symbols_per_card);
+  if (context->deck == NULL)
+  {
+    fprintf(stderr, "No deck with %d symbols per card\n", symbols_per_card);
+    exit(1);
+  }
+
+  deal_cards(&context->deal, context->deck, BENCH_SEED);
+  init_game(&context->pristine_game, context->deck, &context->deal, DEFAULT_PLAYERS_PER_ROOM);
+  memcpy(&context->game, &context->pristine_game, sizeof(game_t));
+
+  room_config_t room_config = {context->deck, 0, DEFAULT_PLAYERS_PER_ROOM};
+  init_room_manager(&context->room_manager, &room_config);
+  context->room = create_room(&context->room_manager);
+  memcpy(&context->room->game, &context->pristine_game, sizeof(game_t));
+  for (int i = 0; i < DEFAULT_PLAYERS_PER_ROOM; i++)
+  {
+    snprintf(context->room->player_list[i].name, MAX_PLAYER_NAME_LENGTH, "Player %d", i);
+  }
+  context->room->protocol_versions = PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_LEGACY) | PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_FRAMED);
+  reset_room_state(context->room);
+  context->sink_length = 0;
+}
+
+/*
+ * Doubles the iteration count until one run takes long enough to time,
+ * then reports the fastest of BENCH_RUNS runs of that size.
+ */
+static void run_benchmark(bench_context_t *context, const benchmark_t *benchmark)
+{
+  long long iterations = 1;
+  unsigned long long elapsed;
+
+  do
+  {
+    iterations *= 2;
+    unsigned long long start = now_ns();
+    benchmark->run(context, iterations);
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NANOSECONDS / BENCH_RUNS);
+
+  unsigned long long best = elapsed;
+  long long allocations = 0;
+  for (int i = 0; i < BENCH_RUNS; i++)
+  {
+    long long allocations_before = allocations_count;
+    unsigned long long start = now_ns();
+    benchmark->run(context, iterations);
+    elapsed = now_ns() - start;
+    allocations = allocations_count - allocations_before;
+    if (elapsed < best)
+    {
+      best = elapsed;
+    }
+  }
+
+  printf("{\"name\":\"%s\",\"symbols_per_card\":%d,\"iterations\":%lld,\"ns_per_op\":%.2f,\"allocs_per_op\":%.4f}\n",
+         benchmark->name, context->deck->symbols_per_card, iterations, (double)best / iterations,
+         (double)allocations / iterations);
+}
+
+int main(int argc, char **argv)
+{
+  int symbols_per_card = DEFAULT_SYMBOLS_PER_CARD;
+  const char *filter = NULL;
+  int option;
+
+  while ((option = getopt(argc, argv, "s:f:")) != -1)
+  {
+    switch (option)
+    {
+    case 's':
+      symbols_per_card = atoi(optarg);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s symbols_per_card] [-f name_filter]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  bench_context_t *context = (bench_context_t *)calloc(1, sizeof(bench_context_t));
+  if (context == NULL)
+  {
+    perror("bench context calloc failed");
+    exit(1);
+  }
+  init_bench_context(context, symbols_per_card);
+
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+  {
+    if (filter == NULL || strstr(benchmarks[i].name, filter) != NULL)
+    {
+      run_benchmark(context, &benchmarks[i]);
+    }
+  }
+
+  release_room(&context->room_manager, context->room);
+  destroy_room_manager(&context->room_manager);
+  destroy_decks();
+  free(context);
+
+  return 0;
+}
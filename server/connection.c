@@ -0,0 +1,521 @@
+#include "connection.h"
+#include "log.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+connection_t *create_connection(int sockfd)
+{
+  connection_t *connection = (connection_t *)malloc(sizeof(connection_t));
+
+  if (connection == NULL)
+  {
+    perror("connection malloc failed");
+    exit(1);
+  }
+
+  connection->source_type = CONNECTION_SOURCE;
+  connection->sockfd = sockfd;
+  connection->state = AWAITING_PLAYER_NAME;
+  connection->protocol_version = PROTOCOL_VERSION_LEGACY;
+  connection->worker = NULL;
+  connection->next_worker = NULL;
+  connection->room = NULL;
+  connection->player_id = -1;
+  connection->is_waiting = 0;
+  connection->lobby_prev = NULL;
+  connection->lobby_next = NULL;
+  connection->handshake_prev = NULL;
+  connection->handshake_next = NULL;
+  connection->input_length = 0;
+  connection->output = NULL;
+  connection->output_offset = 0;
+  connection->output_length = 0;
+  connection->output_capacity = 0;
+  connection->queued_state_offset = -1;
+  connection->queued_state_length = 0;
+  connection->over_budget_since = 0;
+  connection->shared_output_count = 0;
+  connection->is_spectator = 0;
+  connection->close_after_flush = 0;
+  connection->is_broken = 0;
+
+  if (pthread_mutex_init(&connection->output_mutex, NULL) != 0)
+  {
+    perror("connection mutex init failed");
+    exit(1);
+  }
+
+  return connection;
+}
+
+static int send_vector_directly(connection_t *connection, const struct iovec *iov, int iov_count)
+{
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = (struct iovec *)iov;
+  message.msg_iovlen = iov_count;
+
+  while (1)
+  {
+    int sent = sendmsg(connection->sockfd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    record_thread_send(sent);
+
+    if (sent >= 0)
+    {
+      return sent;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      return 0;
+    }
+    if (errno != EINTR)
+    {
+      connection->is_broken = 1;
+      return -1;
+    }
+  }
+}
+
+/*
+ * Drops the first count bytes of the shared output, releasing every
+ * message that went out in full.
+ */
+static void consume_shared_output(connection_t *connection, int count)
+{
+  int sent_messages = 0;
+
+  while (sent_messages < connection->shared_output_count)
+  {
+    shared_output_t *output = &connection->shared_output[sent_messages];
+    int remaining = output->message->length - output->offset;
+
+    if (count < remaining)
+    {
+      output->offset += count;
+      break;
+    }
+    count -= remaining;
+    release_shared_message(output->message);
+    sent_messages++;
+  }
+
+  connection->shared_output_count -= sent_messages;
+  memmove(connection->shared_output, connection->shared_output + sent_messages,
+          connection->shared_output_count * sizeof(shared_output_t));
+}
+
+/*
+ * Sends everything queued in shared messages with one gathered write per
+ * attempt, straight out of the messages.
+ */
+static int write_shared_output(connection_t *connection)
+{
+  struct iovec iov[CONNECTION_SHARED_OUTPUT_SIZE];
+
+  while (connection->shared_output_count > 0)
+  {
+    for (int i = 0; i < connection->shared_output_count; i++)
+    {
+      shared_output_t *output = &connection->shared_output[i];
+      iov[i].iov_base = output->message->data + output->offset;
+      iov[i].iov_len = output->message->length - output->offset;
+    }
+
+    int sent = send_vector_directly(connection, iov, connection->shared_output_count);
+    if (sent <= 0)
+    {
+      return sent;
+    }
+    consume_shared_output(connection, sent);
+  }
+
+  return 0;
+}
+
+/*
+ * A reader that stays over CONNECTION_OUTPUT_BUDGET bytes for
+ * CONNECTION_OVER_BUDGET_NANOSECONDS even though its states are coalesced
+ * is cut off, so a burst it catches up with is forgiven. Going past
+ * CONNECTION_OUTPUT_LIMIT cuts it off right away. Shutting the socket down
+ * wakes up the owning worker, which then closes the connection.
+ */
+static int check_output_budget(connection_t *connection)
+{
+  int queued = connection->output_length - connection->output_offset;
+
+  if (queued <= CONNECTION_OUTPUT_BUDGET)
+  {
+    connection->over_budget_since = 0;
+    return 0;
+  }
+  if (connection->over_budget_since == 0)
+  {
+    connection->over_budget_since = stats_now_ns();
+  }
+  if (queued <= CONNECTION_OUTPUT_LIMIT &&
+      stats_now_ns() - connection->over_budget_since < CONNECTION_OVER_BUDGET_NANOSECONDS)
+  {
+    return 0;
+  }
+
+  LOG_WARN("Player %d has %d bytes of output queued, disconnecting\n", connection->player_id,
+           connection->output_length - connection->output_offset);
+  connection->is_broken = 1;
+  shutdown(connection->sockfd, SHUT_RDWR);
+  return -1;
+}
+
+static int write_pending_output(connection_t *connection)
+{
+  while (connection->output_offset < connection->output_length)
+  {
+    int sent = send(connection->sockfd, connection->output + connection->output_offset,
+                    connection->output_length - connection->output_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    record_thread_send(sent);
+    if (sent < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return check_output_budget(connection);
+      }
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      connection->is_broken = 1;
+      return -1;
+    }
+    connection->output_offset += sent;
+    if (connection->output_offset > connection->queued_state_offset)
+    {
+      connection->queued_state_offset = -1;
+    }
+  }
+
+  connection->output_offset = 0;
+  connection->output_length = 0;
+  connection->over_budget_since = 0;
+  return write_shared_output(connection);
+}
+
+static int reserve_output(connection_t *connection, int length)
+{
+  if (connection->output_offset > 0)
+  {
+    memmove(connection->output, connection->output + connection->output_offset,
+            connection->output_length - connection->output_offset);
+    connection->output_length -= connection->output_offset;
+    if (connection->queued_state_offset >= 0)
+    {
+      connection->queued_state_offset -= connection->output_offset;
+    }
+    connection->output_offset = 0;
+  }
+
+  if (connection->output_length + length <= connection->output_capacity)
+  {
+    return 0;
+  }
+
+  int capacity = connection->output_capacity > 0 ? connection->output_capacity : CONNECTION_OUTPUT_BUFFER_INITIAL_CAPACITY;
+  while (capacity < connection->output_length + length)
+  {
+    capacity *= 2;
+  }
+
+  char *output = (char *)realloc(connection->output, capacity);
+  if (output == NULL)
+  {
+    perror("connection output realloc failed");
+    return -1;
+  }
+
+  connection->output = output;
+  connection->output_capacity = capacity;
+  return 0;
+}
+
+/*
+ * Removes a state message that is still queued in full. The state it
+ * carries is superseded by the one about to be queued.
+ */
+static void drop_queued_state(connection_t *connection)
+{
+  int state_end = connection->queued_state_offset + connection->queued_state_length;
+
+  memmove(connection->output + connection->queued_state_offset, connection->output + state_end,
+          connection->output_length - state_end);
+  connection->output_length -= connection->queued_state_length;
+  connection->queued_state_offset = -1;
+}
+
+/*
+ * Sends the gathered buffers with a single sendmsg when nothing is queued
+ * on the connection yet. Whatever the socket does not accept without
+ * blocking is copied to the output buffer and flushed by the owning worker
+ * once the socket becomes writable again. When state_index names one of
+ * the buffers as a state message, a state still waiting in the output
+ * buffer is dropped in its favour.
+ */
+static int queue_output(connection_t *connection, const struct iovec *iov, int iov_count, int state_index)
+{
+  int result = 0;
+
+  pthread_mutex_lock(&connection->output_mutex);
+
+  if (connection->is_broken)
+  {
+    pthread_mutex_unlock(&connection->output_mutex);
+    return -1;
+  }
+
+  if (state_index >= 0 && connection->queued_state_offset >= 0)
+  {
+    drop_queued_state(connection);
+  }
+
+  int skipped = 0;
+  if (connection->output_offset == connection->output_length)
+  {
+    skipped = send_vector_directly(connection, iov, iov_count);
+  }
+
+  for (int i = 0; i < iov_count && skipped >= 0; i++)
+  {
+    int length = (int)iov[i].iov_len;
+
+    if (skipped >= length)
+    {
+      skipped -= length;
+      continue;
+    }
+
+    if (reserve_output(connection, length - skipped) < 0)
+    {
+      connection->is_broken = 1;
+      result = -1;
+      break;
+    }
+    if (i == state_index && skipped == 0)
+    {
+      connection->queued_state_offset = connection->output_length;
+      connection->queued_state_length = length;
+    }
+    memcpy(connection->output + connection->output_length, (char *)iov[i].iov_base + skipped, length - skipped);
+    connection->output_length += length - skipped;
+    skipped = 0;
+  }
+
+  if (skipped < 0)
+  {
+    result = -1;
+  }
+  else if (result == 0)
+  {
+    result = check_output_budget(connection);
+  }
+
+  pthread_mutex_unlock(&connection->output_mutex);
+
+  return result;
+}
+
+int connection_sendv(connection_t *connection, const struct iovec *iov, int iov_count)
+{
+  return queue_output(connection, iov, iov_count, -1);
+}
+
+/*
+ * Like connection_sendv, with iov[state_index] being a state message that
+ * replaces any older state the client has not started receiving yet.
+ * Return codes and other messages around it keep their order.
+ */
+int connection_send_state(connection_t *connection, const struct iovec *iov, int iov_count, int state_index)
+{
+  return queue_output(connection, iov, iov_count, state_index);
+}
+
+/*
+ * Removes the shared state messages nothing was sent of yet, superseded by
+ * the state about to be queued.
+ */
+static void drop_queued_shared_states(connection_t *connection)
+{
+  int kept_count = 0;
+
+  for (int i = 0; i < connection->shared_output_count; i++)
+  {
+    shared_output_t *output = &connection->shared_output[i];
+
+    if (output->is_state && output->offset == 0)
+    {
+      release_shared_message(output->message);
+      continue;
+    }
+    connection->shared_output[kept_count++] = *output;
+  }
+
+  connection->shared_output_count = kept_count;
+}
+
+/*
+ * Queues shared messages by reference. When nothing is queued yet they go
+ * out right away with a single gathered write and whatever the socket does
+ * not take stays queued without being copied. With is_state, they replace
+ * the state messages still waiting in full. Since older states are dropped
+ * rather than piling up, a connection whose queue still overflows is cut
+ * off like one over its output budget.
+ */
+int connection_send_shared(connection_t *connection, shared_message_t **messages, int count, int is_state)
+{
+  int result = 0;
+
+  pthread_mutex_lock(&connection->output_mutex);
+
+  if (connection->is_broken)
+  {
+    pthread_mutex_unlock(&connection->output_mutex);
+    return -1;
+  }
+
+  if (is_state)
+  {
+    drop_queued_shared_states(connection);
+  }
+  if (connection->shared_output_count + count > CONNECTION_SHARED_OUTPUT_SIZE)
+  {
+    LOG_WARN("Spectator has %d messages queued, disconnecting\n", connection->shared_output_count);
+    connection->is_broken = 1;
+    shutdown(connection->sockfd, SHUT_RDWR);
+    pthread_mutex_unlock(&connection->output_mutex);
+    return -1;
+  }
+
+  int is_idle = connection->shared_output_count == 0 && connection->output_offset == connection->output_length;
+  for (int i = 0; i < count; i++)
+  {
+    shared_output_t *output = &connection->shared_output[connection->shared_output_count++];
+    retain_shared_message(messages[i]);
+    output->message = messages[i];
+    output->offset = 0;
+    output->is_state = is_state;
+  }
+  if (is_idle)
+  {
+    result = write_shared_output(connection);
+  }
+
+  pthread_mutex_unlock(&connection->output_mutex);
+
+  return result;
+}
+
+/*
+ * Tells whether an unsent state is waiting in the output buffer or in the
+ * shared output, in which case the next state must not depend on it.
+ */
+int connection_has_queued_state(connection_t *connection)
+{
+  pthread_mutex_lock(&connection->output_mutex);
+  int has_queued_state = connection->queued_state_offset >= 0;
+  for (int i = 0; i < connection->shared_output_count && !has_queued_state; i++)
+  {
+    has_queued_state = connection->shared_output[i].is_state && connection->shared_output[i].offset == 0;
+  }
+  pthread_mutex_unlock(&connection->output_mutex);
+
+  return has_queued_state;
+}
+
+int connection_send(connection_t *connection, const void *data, int length)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = length;
+
+  return connection_sendv(connection, &iov, 1);
+}
+
+int connection_flush(connection_t *connection)
+{
+  pthread_mutex_lock(&connection->output_mutex);
+  int result = connection->is_broken ? -1 : write_pending_output(connection);
+  pthread_mutex_unlock(&connection->output_mutex);
+
+  return result;
+}
+
+void connection_close_after_flush(connection_t *connection)
+{
+  pthread_mutex_lock(&connection->output_mutex);
+  connection->close_after_flush = 1;
+  pthread_mutex_unlock(&connection->output_mutex);
+}
+
+int connection_should_close(connection_t *connection)
+{
+  pthread_mutex_lock(&connection->output_mutex);
+  int should_close = connection->is_broken ||
+                     (connection->close_after_flush && connection->output_length == connection->output_offset &&
+                      connection->shared_output_count == 0);
+  pthread_mutex_unlock(&connection->output_mutex);
+
+  return should_close;
+}
+
+/*
+ * Queues output another process accepted but did not send yet, with the
+ * offset of its unsent state message or -1, as the connection is handed
+ * over to this one.
+ */
+int restore_connection_output(connection_t *connection, const char *data, int length, int queued_state_offset,
+                              int queued_state_length)
+{
+  if (length == 0)
+  {
+    return 0;
+  }
+  if (reserve_output(connection, length) < 0)
+  {
+    return -1;
+  }
+
+  memcpy(connection->output, data, length);
+  connection->output_length = length;
+  connection->queued_state_offset = queued_state_offset;
+  connection->queued_state_length = queued_state_length;
+  return 0;
+}
+
+void destroy_connection(connection_t *connection)
+{
+  close(connection->sockfd);
+  for (int i = 0; i < connection->shared_output_count; i++)
+  {
+    release_shared_message(connection->shared_output[i].message);
+  }
+  pthread_mutex_destroy(&connection->output_mutex);
+  free(connection->output);
+  free(connection);
+}
+
+/*
+ * Sums the send counters every worker keeps for itself, so sending never
+ * touches a cache line shared with the other workers.
+ */
+void read_connection_counters(connection_counters_t *counters)
+{
+  counters->send_calls = 0;
+  counters->bytes_sent = 0;
+  for (thread_stats_t *stats = get_all_thread_stats(); stats != NULL; stats = stats->next)
+  {
+    counters->send_calls += __atomic_load_n(&stats->send_calls, __ATOMIC_RELAXED);
+    counters->bytes_sent += __atomic_load_n(&stats->bytes_sent, __ATOMIC_RELAXED);
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include "room.h"
+
+#define CONNECTION_INPUT_BUFFER_SIZE 512
+#define CONNECTION_OUTPUT_BUFFER_INITIAL_CAPACITY 512
+#define CONNECTION_OUTPUT_BUDGET (64 * 1024)
+#define CONNECTION_OUTPUT_LIMIT (4 * CONNECTION_OUTPUT_BUDGET)
+#define CONNECTION_OVER_BUDGET_NANOSECONDS 1000000000ULL
+#define CONNECTION_SHARED_OUTPUT_SIZE 8
+
+typedef enum connection_state
+{
+  AWAITING_PLAYER_NAME,
+  AWAITING_REQUESTS,
+} connection_state_t;
+
+/*
+ * A shared message queued on a connection and how much of it was sent.
+ * State messages nothing was sent of yet are superseded by newer ones.
+ */
+typedef struct
+{
+  shared_message_t *message;
+  int offset;
+  int is_state;
+} shared_output_t;
+
+/*
+ * Shared output is only queued once a spectator has joined a room, after
+ * everything in its own output buffer, which is always sent first.
+ */
+typedef struct connection
+{
+  poll_source_type_t source_type;
+  int sockfd;
+  connection_state_t state;
+  int protocol_version;
+  struct worker *worker;
+  struct worker *next_worker;
+  room_t *room;
+  int player_id;
+  char name[MAX_PLAYER_NAME_LENGTH];
+  int is_waiting;
+  struct connection *lobby_prev;
+  struct connection *lobby_next;
+  struct connection *handshake_prev;
+  struct connection *handshake_next;
+  int input_length;
+  char input[CONNECTION_INPUT_BUFFER_SIZE];
+  pthread_mutex_t output_mutex;
+  char *output;
+  int output_offset;
+  int output_length;
+  int output_capacity;
+  int queued_state_offset;
+  int queued_state_length;
+  uint64_t over_budget_since;
+  shared_output_t shared_output[CONNECTION_SHARED_OUTPUT_SIZE];
+  int shared_output_count;
+  int is_spectator;
+  int close_after_flush;
+  int is_broken;
+} connection_t;
+
+typedef struct
+{
+  unsigned long send_calls;
+  unsigned long bytes_sent;
+} connection_counters_t;
+
+connection_t *create_connection(int sockfd);
+
+int connection_send(connection_t *connection, const void *data, int length);
+
+int connection_sendv(connection_t *connection, const struct iovec *iov, int iov_count);
+
+int connection_send_state(connection_t *connection, const struct iovec *iov, int iov_count, int state_index);
+
+int connection_send_shared(connection_t *connection, shared_message_t **messages, int count, int is_state);
+
+int connection_has_queued_state(connection_t *connection);
+
+int connection_flush(connection_t *connection);
+
+void connection_close_after_flush(connection_t *connection);
+
+int connection_should_close(connection_t *connection);
+
+int restore_connection_output(connection_t *connection, const char *data, int length, int queued_state_offset,
+                              int queued_state_length);
+
+void destroy_connection(connection_t *connection);
+
+void read_connection_counters(connection_counters_t *counters);
+
+#endif
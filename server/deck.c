@@ -0,0 +1,343 @@
+#include "deck.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+  int size;
+  int add[MAX_DECK_ORDER][MAX_DECK_ORDER];
+  int multiply[MAX_DECK_ORDER][MAX_DECK_ORDER];
+} galois_field_t;
+
+static deck_t *decks[MAX_DECK_ORDER + 1];
+static pthread_mutex_t decks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int prime_power_base(int order, int *exponent)
+{
+  *exponent = 0;
+  if (order < 2)
+  {
+    return 0;
+  }
+
+  int prime = 2;
+  while (order % prime != 0)
+  {
+    prime++;
+  }
+
+  while (order % prime == 0)
+  {
+    order /= prime;
+    (*exponent)++;
+  }
+
+  return order == 1 ? prime : 0;
+}
+
+int is_valid_deck_order(int order)
+{
+  int exponent;
+  return order <= MAX_DECK_ORDER && prime_power_base(order, &exponent) != 0;
+}
+
+/*
+ * Multiplies two polynomials over GF(prime) given as base-prime digit
+ * strings and reduces the product by the monic polynomial modulus of the
+ * given degree.
+ */
+static int multiply_polynomials(int first, int second, int prime, int degree, const int *modulus)
+{
+  int product[2 * MAX_DECK_ORDER] = {0};
+  int first_digits[MAX_DECK_ORDER] = {0};
+  int second_digits[MAX_DECK_ORDER] = {0};
+
+  for (int i = 0; i < degree; i++)
+  {
+    first_digits[i] = first % prime;
+    first /= prime;
+    second_digits[i] = second % prime;
+    second /= prime;
+  }
+
+  for (int i = 0; i < degree; i++)
+  {
+    for (int j = 0; j < degree; j++)
+    {
+      product[i + j] = (product[i + j] + first_digits[i] * second_digits[j]) % prime;
+    }
+  }
+
+  for (int i = 2 * degree - 2; i >= degree; i--)
+  {
+    int coefficient = product[i];
+    for (int j = 0; j <= degree; j++)
+    {
+      product[i - degree + j] = ((product[i - degree + j] - coefficient * modulus[j]) % prime + prime) % prime;
+    }
+  }
+
+  int result = 0;
+  for (int i = degree - 1; i >= 0; i--)
+  {
+    result = result * prime + product[i];
+  }
+
+  return result;
+}
+
+/*
+ * Builds the addition and multiplication tables of GF(prime^degree). For
+ * the degrees that fit under MAX_DECK_ORDER (at most 3) a monic polynomial
+ * is irreducible exactly when it has no root, so the first root-free one
+ * is used as the modulus.
+ */
+static void init_galois_field(galois_field_t *field, int prime, int degree)
+{
+  int modulus[MAX_DECK_ORDER + 1] = {0};
+  int size = 1;
+
+  for (int i = 0; i < degree; i++)
+  {
+    size *= prime;
+  }
+  field->size = size;
+  modulus[degree] = 1;
+
+  if (degree > 1)
+  {
+    for (int candidate = 0; candidate < size; candidate++)
+    {
+      int has_root = 0;
+      for (int i = 0, digits = candidate; i < degree; i++, digits /= prime)
+      {
+        modulus[i] = digits % prime;
+      }
+      for (int x = 0; x < prime && !has_root; x++)
+      {
+        int value = 0;
+        for (int i = degree; i >= 0; i--)
+        {
+          value = (value * x + modulus[i]) % prime;
+        }
+        has_root = value == 0;
+      }
+      if (!has_root)
+      {
+        break;
+      }
+    }
+  }
+
+  for (int a = 0; a < size; a++)
+  {
+    for (int b = 0; b < size; b++)
+    {
+      int sum = 0;
+      for (int i = 0, place = 1, x = a, y = b; i < degree; i++, place *= prime, x /= prime, y /= prime)
+      {
+        sum += ((x % prime + y % prime) % prime) * place;
+      }
+      field->add[a][b] = sum;
+      field->multiply[a][b] = degree == 1 ? (a * b) % prime : multiply_polynomials(a, b, prime, degree, modulus);
+    }
+  }
+}
+
+static void set_card_symbol(deck_t *deck, int card_index, int position, int symbol)
+{
+  deck->cards[card_index * deck->symbols_per_card + position] = symbol;
+}
+
+/*
+ * Lays out the projective plane of order n. Symbols 0..n^2-1 are the affine
+ * points (x, y) as x * n + y, n^2 + m is the point at infinity of slope m
+ * and n^2 + n the vertical one. Cards are the lines y = m * x + b, the
+ * verticals x = c and the line at infinity.
+ */
+static void build_cards(deck_t *deck, galois_field_t *field)
+{
+  int n = deck->order;
+  int card_index = 0;
+
+  for (int m = 0; m < n; m++)
+  {
+    for (int b = 0; b < n; b++, card_index++)
+    {
+      for (int x = 0; x < n; x++)
+      {
+        set_card_symbol(deck, card_index, x, x * n + field->add[field->multiply[m][x]][b]);
+      }
+      set_card_symbol(deck, card_index, n, n * n + m);
+    }
+  }
+
+  for (int c = 0; c < n; c++, card_index++)
+  {
+    for (int y = 0; y < n; y++)
+    {
+      set_card_symbol(deck, card_index, y, c * n + y);
+    }
+    set_card_symbol(deck, card_index, n, n * n + n);
+  }
+
+  for (int m = 0; m <= n; m++)
+  {
+    set_card_symbol(deck, card_index, m, n * n + m);
+  }
+}
+
+static void *allocate_deck_table(int count, int size)
+{
+  void *table = calloc(count, size);
+
+  if (table == NULL)
+  {
+    perror("deck table calloc failed");
+    exit(1);
+  }
+
+  return table;
+}
+
+/*
+ * Builds a deck together with the symbol mask of every card, its
+ * positional weight in the board hash and the symbol shared by every pair
+ * of cards, and checks the one-shared-symbol property.
+ */
+static deck_t *build_deck(int order)
+{
+  int prime, exponent;
+  galois_field_t field;
+  deck_t *deck = (deck_t *)allocate_deck_table(1, sizeof(deck_t));
+
+  prime = prime_power_base(order, &exponent);
+  init_galois_field(&field, prime, exponent);
+
+  deck->order = order;
+  deck->symbols_per_card = order + 1;
+  deck->cards_count = order * order + order + 1;
+  deck->symbols_count = deck->cards_count;
+  deck->cards = (int *)allocate_deck_table(deck->cards_count * deck->symbols_per_card, sizeof(int));
+  deck->masks = (card_mask_t *)allocate_deck_table(deck->cards_count, sizeof(card_mask_t));
+  deck->weights = (int *)allocate_deck_table(deck->cards_count, sizeof(int));
+  deck->pair_symbols = (int16_t *)allocate_deck_table(deck->cards_count * deck->cards_count, sizeof(int16_t));
+
+  build_cards(deck, &field);
+
+  for (int i = 0; i < deck->cards_count; i++)
+  {
+    const int *symbols = get_card_symbols(deck, i);
+    for (int j = 0; j < deck->symbols_per_card; j++)
+    {
+      deck->masks[i].words[symbols[j] >> 6] |= (uint64_t)1 << (symbols[j] & 63);
+      deck->weights[i] += symbols[j] * (j + 1);
+    }
+  }
+
+  for (int i = 0; i < deck->cards_count; i++)
+  {
+    for (int j = 0; j < deck->cards_count; j++)
+    {
+      int shared = 0;
+      for (int w = 0; w < CARD_MASK_WORDS; w++)
+      {
+        shared += __builtin_popcountll(deck->masks[i].words[w] & deck->masks[j].words[w]);
+      }
+      if (i != j && shared != 1)
+      {
+        fprintf(stderr, "Deck of order %d has cards %d and %d sharing %d symbols\n", order, i, j, shared);
+        abort();
+      }
+      deck->pair_symbols[i * deck->cards_count + j] = i == j ? -1 : find_common_symbol(&deck->masks[i], &deck->masks[j]);
+    }
+  }
+
+  return deck;
+}
+
+/*
+ * Returns the shared deck with the given number of symbols per card,
+ * building it on first use. Returns NULL when no projective plane of that
+ * size is supported.
+ */
+const deck_t *get_deck(int symbols_per_card)
+{
+  int order = symbols_per_card - 1;
+
+  if (!is_valid_deck_order(order))
+  {
+    return NULL;
+  }
+
+  deck_t *deck = __atomic_load_n(&decks[order], __ATOMIC_ACQUIRE);
+  if (deck != NULL)
+  {
+    return deck;
+  }
+
+  pthread_mutex_lock(&decks_mutex);
+  deck = decks[order];
+  if (deck == NULL)
+  {
+    deck = build_deck(order);
+    __atomic_store_n(&decks[order], deck, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&decks_mutex);
+
+  return deck;
+}
+
+const int *get_card_symbols(const deck_t *deck, int card_index)
+{
+  return deck->cards + card_index * deck->symbols_per_card;
+}
+
+int card_has_symbol(const deck_t *deck, int card_index, int symbol)
+{
+  if ((unsigned int)symbol >= (unsigned int)deck->symbols_count)
+  {
+    return 0;
+  }
+
+  return (deck->masks[card_index].words[symbol >> 6] >> (symbol & 63)) & 1;
+}
+
+int find_common_symbol(const card_mask_t *first_card_mask, const card_mask_t *second_card_mask)
+{
+  for (int w = 0; w < CARD_MASK_WORDS; w++)
+  {
+    uint64_t common = first_card_mask->words[w] & second_card_mask->words[w];
+    if (common != 0)
+    {
+      return w * 64 + __builtin_ctzll(common);
+    }
+  }
+
+  return -1;
+}
+
+int common_symbol(const deck_t *deck, int first_card_index, int second_card_index)
+{
+  return deck->pair_symbols[first_card_index * deck->cards_count + second_card_index];
+}
+
+void destroy_decks(void)
+{
+  pthread_mutex_lock(&decks_mutex);
+  for (int i = 0; i <= MAX_DECK_ORDER; i++)
+  {
+    if (decks[i] != NULL)
+    {
+      free(decks[i]->cards);
+      free(decks[i]->masks);
+      free(decks[i]->weights);
+      free(decks[i]->pair_symbols);
+      free(decks[i]);
+      decks[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&decks_mutex);
+}
@@ -0,0 +1,49 @@
+#ifndef DECK_H
+#define DECK_H
+
+#include <stdint.h>
+
+#define MAX_DECK_ORDER 13
+#define MAX_SYMBOLS_PER_CARD (MAX_DECK_ORDER + 1)
+#define MAX_DECK_CARDS (MAX_DECK_ORDER * MAX_DECK_ORDER + MAX_DECK_ORDER + 1)
+#define MAX_SYMBOLS MAX_DECK_CARDS
+#define CARD_MASK_WORDS ((MAX_SYMBOLS + 63) / 64)
+#define DEFAULT_SYMBOLS_PER_CARD 8
+
+typedef struct
+{
+  uint64_t words[CARD_MASK_WORDS];
+} card_mask_t;
+
+/*
+ * Immutable deck of the projective plane of a prime power order n: n^2+n+1
+ * cards of n+1 symbols, any two cards sharing exactly one symbol. Decks are
+ * built once per order and shared by every room that plays with them.
+ */
+typedef struct
+{
+  int order;
+  int symbols_per_card;
+  int cards_count;
+  int symbols_count;
+  int *cards;
+  card_mask_t *masks;
+  int *weights;
+  int16_t *pair_symbols;
+} deck_t;
+
+int is_valid_deck_order(int order);
+
+const deck_t *get_deck(int symbols_per_card);
+
+const int *get_card_symbols(const deck_t *deck, int card_index);
+
+int card_has_symbol(const deck_t *deck, int card_index, int symbol);
+
+int find_common_symbol(const card_mask_t *first_card_mask, const card_mask_t *second_card_mask);
+
+int common_symbol(const deck_t *deck, int first_card_index, int second_card_index);
+
+void destroy_decks(void);
+
+#endif
@@ -1,10 +1,15 @@
+#ifndef GAME_H
+#define GAME_H
+
 #include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "deck.h"
+#include "rng.h"
 
-#define SYMBOLS_PER_CARD 8
-#define SYMBOLS_COUNT 56
 #define DEFAULT_STARTING_CARDS_COUNT 12
 #define DEFAULT_SWAPS_COUNT 2
 #define SWAPS_COOLDOWN 3
@@ -13,6 +18,8 @@
 #define DEFAULT_REROLLS_COUNT 2
 #define REROLLS_COOLDOWN 3
 #define CHECKSUM_MODULO 21372137
+#define MAX_GAME_PLAYERS 8
+#define CACHE_LINE_SIZE 64
 
 typedef enum return_code {
   SUCCESS,
@@ -24,28 +31,59 @@ typedef enum return_code {
   INCORRECT_BOARD_HASH,
 } return_code_t;
 
+#define RETURN_CODES_COUNT (INCORRECT_BOARD_HASH + 1)
+
+/*
+ * Packed per-seat state. Cards are indices into the deck and every counter
+ * fits in a byte, so all seats of a game share two cache lines.
+ */
 typedef struct player_state
 {
-  int player_id;
-  int current_card[SYMBOLS_PER_CARD];
-  int cards_in_hand_count;
-  int swaps_left;
-  int swaps_cooldown;
-  int freezes_left;
-  int freezes_cooldown;
-  int rerolls_left;
-  int rerolls_cooldown;
-  int is_frozen_count;
+  uint8_t player_id;
+  uint8_t current_card_index;
+  uint8_t cards_in_hand_count;
+  uint8_t swaps_left;
+  uint8_t swaps_cooldown;
+  uint8_t freezes_left;
+  uint8_t freezes_cooldown;
+  uint8_t rerolls_left;
+  uint8_t rerolls_cooldown;
+  uint8_t is_frozen_count;
 } player_state_t;
 
+/*
+ * The shuffled deck a game draws from, fixed by its seed. It never changes
+ * during the game, so the copies of a game's state share it by pointer.
+ */
+typedef struct deal
+{
+  uint64_t seed;
+  uint8_t card_order[MAX_DECK_CARDS];
+} deal_t;
+
+/*
+ * The board hash is kept up to date by every state transition: cards_hash
+ * holds the card terms reduced modulo CHECKSUM_MODULO and counters_hash the
+ * sum of the individually reduced ability counter terms, exactly as
+ * calculate_board_hash adds them up.
+ */
 typedef struct game
 {
-  player_state_t *player_states;
-  int players_count;
-  int current_top_card[SYMBOLS_PER_CARD];
-  int has_finished;
+  const deck_t *deck;
+  const deal_t *deal;
+  int32_t cards_hash;
+  int32_t counters_hash;
+  uint8_t players_count;
+  uint8_t current_top_card_index;
+  uint8_t has_finished;
+  uint16_t used_cards_count;
+  player_state_t player_states[MAX_GAME_PLAYERS];
 } game_t;
 
+typedef char card_index_fits_in_a_byte[MAX_DECK_CARDS <= UINT8_MAX + 1 ? 1 : -1];
+
+typedef char game_fits_in_two_cache_lines[sizeof(game_t) <= 2 * CACHE_LINE_SIZE ? 1 : -1];
+
 typedef enum actions {
   CARD,
   SWAP,
@@ -53,30 +91,45 @@ typedef enum actions {
   REROLL
 } actions_type_t;
 
+/*
+ * The state version an action was made against, or 0 when the client only
+ * identifies the state it saw by its board hash.
+ */
 typedef struct action {
   actions_type_t action_type;
   int id;
   int board_hash;
+  uint32_t state_version;
 } action_t;
 
 int calculate_board_hash(game_t *game);
 
+int get_board_hash(game_t *game);
+
+void verify_board_hash(game_t *game);
+
+void reset_board_hash(game_t *game);
+
 void set_starting_card(game_t *game);
 
-void set_player_card(player_state_t *player_state);
+void set_player_card(game_t *game, player_state_t *player_state);
 
 return_code_t act_player(game_t *game, action_t *action, int current_player_id);
 
 void make_post_turn_actions(game_t *game);
 
-return_code_t swap_cards(player_state_t *acting_player_state, player_state_t *target_player_state);
+return_code_t swap_cards(game_t *game, player_state_t *acting_player_state, player_state_t *target_player_state);
 
 return_code_t checking_guess(game_t *game, action_t *action, int current_player_id);
 
 player_state_t *get_player_state_by_id(game_t *game, int id);
 
-void init_game_player(game_t *game, int index, int id);
+void init_game_player(game_t *game, int index);
 
-void init_game(game_t *game, int *player_ids, int players_count);
+void deal_cards(deal_t *deal, const deck_t *deck, uint64_t seed);
+
+void init_game(game_t *game, const deck_t *deck, const deal_t *deal, int players_count);
 
 void destroy_game(game_t *game);
+
+#endif
@@ -0,0 +1,1090 @@
+#include "handoff.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef struct
+{
+  message_buffer_t data;
+  int *fds;
+  int fds_count;
+  int fds_capacity;
+} handoff_writer_t;
+
+/*
+ * Reads past the end or out-of-range values mark the reader invalid and
+ * read as zero, so the parser only checks once at the end.
+ */
+typedef struct
+{
+  const uint8_t *data;
+  int length;
+  int offset;
+  const int *fds;
+  int fds_count;
+  int version;
+  int is_invalid;
+} handoff_reader_t;
+
+static void write_u8(handoff_writer_t *writer, uint8_t value)
+{
+  append_message_u8(&writer->data, value);
+}
+
+static void write_le32(handoff_writer_t *writer, int32_t value)
+{
+  append_message_le32(&writer->data, value);
+}
+
+static void write_le64(handoff_writer_t *writer, uint64_t value)
+{
+  write_le32(writer, (int32_t)(uint32_t)value);
+  write_le32(writer, (int32_t)(uint32_t)(value >> 32));
+}
+
+static void write_bytes(handoff_writer_t *writer, const void *data, int length)
+{
+  if (length > 0)
+  {
+    append_message_bytes(&writer->data, data, length);
+  }
+}
+
+static void write_fd(handoff_writer_t *writer, int fd)
+{
+  if (writer->fds_count == writer->fds_capacity)
+  {
+    writer->fds_capacity = writer->fds_capacity > 0 ? writer->fds_capacity * 2 : 64;
+    writer->fds = (int *)realloc(writer->fds, writer->fds_capacity * sizeof(int));
+    if (writer->fds == NULL)
+    {
+      perror("handoff fds realloc failed");
+      exit(1);
+    }
+  }
+  writer->fds[writer->fds_count] = fd;
+  write_le32(writer, writer->fds_count++);
+}
+
+static const uint8_t *read_bytes(handoff_reader_t *reader, int length)
+{
+  if (reader->is_invalid || length < 0 || length > reader->length - reader->offset)
+  {
+    reader->is_invalid = 1;
+    return NULL;
+  }
+
+  const uint8_t *bytes = reader->data + reader->offset;
+  reader->offset += length;
+  return bytes;
+}
+
+static uint8_t read_u8(handoff_reader_t *reader)
+{
+  const uint8_t *bytes = read_bytes(reader, 1);
+  return bytes != NULL ? bytes[0] : 0;
+}
+
+static int32_t read_le32(handoff_reader_t *reader)
+{
+  const uint8_t *bytes = read_bytes(reader, 4);
+  if (bytes == NULL)
+  {
+    return 0;
+  }
+  return (int32_t)(bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+}
+
+static uint64_t read_le64(handoff_reader_t *reader)
+{
+  uint64_t low = (uint32_t)read_le32(reader);
+  uint64_t high = (uint32_t)read_le32(reader);
+  return low | high << 32;
+}
+
+static void copy_bytes(handoff_reader_t *reader, void *destination, int length)
+{
+  const uint8_t *bytes = read_bytes(reader, length);
+  if (bytes != NULL)
+  {
+    memcpy(destination, bytes, length);
+  }
+}
+
+static int read_fd(handoff_reader_t *reader)
+{
+  int index = read_le32(reader);
+
+  if (index < 0 || index >= reader->fds_count)
+  {
+    reader->is_invalid = 1;
+    return -1;
+  }
+  return reader->fds[index];
+}
+
+static int read_count(handoff_reader_t *reader, int max_count)
+{
+  int count = read_le32(reader);
+
+  if (count < 0 || count > max_count)
+  {
+    reader->is_invalid = 1;
+    return 0;
+  }
+  return count;
+}
+
+/*
+ * Shared states nothing was sent of yet are left out, the new server
+ * queues a fresh snapshot for the spectator instead.
+ */
+static int is_shared_output_kept(const shared_output_t *output)
+{
+  return !output->is_state || output->offset > 0;
+}
+
+static void write_connection(handoff_writer_t *writer, connection_t *connection)
+{
+  int pending_length = connection->output_length - connection->output_offset;
+  int queued_state_offset = connection->queued_state_offset;
+
+  for (int i = 0; i < connection->shared_output_count; i++)
+  {
+    shared_output_t *output = &connection->shared_output[i];
+    if (is_shared_output_kept(output))
+    {
+      pending_length += output->message->length - output->offset;
+    }
+  }
+
+  write_fd(writer, connection->sockfd);
+  write_le32(writer, connection->worker->worker_id);
+  write_u8(writer, connection->state);
+  write_u8(writer, connection->protocol_version);
+  write_le32(writer, connection->player_id);
+  write_bytes(writer, connection->name, MAX_PLAYER_NAME_LENGTH);
+  write_u8(writer, connection->close_after_flush);
+  write_le32(writer, connection->input_length);
+  write_bytes(writer, connection->input, connection->input_length);
+  write_le32(writer, pending_length);
+  write_bytes(writer, connection->output + connection->output_offset,
+              connection->output_length - connection->output_offset);
+  for (int i = 0; i < connection->shared_output_count; i++)
+  {
+    shared_output_t *output = &connection->shared_output[i];
+    if (is_shared_output_kept(output))
+    {
+      write_bytes(writer, output->message->data + output->offset, output->message->length - output->offset);
+    }
+  }
+  write_le32(writer, queued_state_offset >= 0 ? queued_state_offset - connection->output_offset : -1);
+  write_le32(writer, connection->queued_state_length);
+}
+
+/*
+ * Recreates a connection with its partial input and unsent output and
+ * polls it on the worker with the same index, or a lower one when this
+ * server runs fewer workers.
+ */
+static connection_t *read_connection(server_t *server, handoff_reader_t *reader)
+{
+  int sockfd = read_fd(reader);
+  int worker_id = read_le32(reader);
+
+  if (reader->is_invalid)
+  {
+    return NULL;
+  }
+
+  connection_t *connection = create_connection(sockfd);
+  connection->worker = &server->workers[(uint32_t)worker_id % server->workers_count];
+  connection->state = read_u8(reader) == AWAITING_REQUESTS ? AWAITING_REQUESTS : AWAITING_PLAYER_NAME;
+  connection->protocol_version = read_u8(reader);
+  connection->player_id = read_le32(reader);
+  copy_bytes(reader, connection->name, MAX_PLAYER_NAME_LENGTH);
+  connection->close_after_flush = read_u8(reader);
+  connection->input_length = read_count(reader, CONNECTION_INPUT_BUFFER_SIZE);
+  copy_bytes(reader, connection->input, connection->input_length);
+
+  int output_length = read_count(reader, reader->length);
+  const uint8_t *output = read_bytes(reader, output_length);
+  int queued_state_offset = read_le32(reader);
+  int queued_state_length = read_le32(reader);
+
+  if (connection->protocol_version != PROTOCOL_VERSION_LEGACY && connection->protocol_version != PROTOCOL_VERSION_FRAMED)
+  {
+    reader->is_invalid = 1;
+  }
+  if (queued_state_offset < -1 ||
+      (queued_state_offset >= 0 && (queued_state_length < 0 || queued_state_offset + queued_state_length > output_length)))
+  {
+    reader->is_invalid = 1;
+  }
+  if (!reader->is_invalid &&
+      restore_connection_output(connection, (const char *)output, output_length, queued_state_offset, queued_state_length) < 0)
+  {
+    reader->is_invalid = 1;
+  }
+
+  register_connection(connection);
+  return connection;
+}
+
+static int has_live_connections(room_t *room)
+{
+  for (int i = 0; i < MAX_PLAYERS; i++)
+  {
+    connection_t *connection = room->player_list[i].connection;
+    if (connection != NULL && !connection->is_broken)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * The game goes field by field rather than as a raw game_t, so the newer
+ * binary may lay the state out differently. The board hash is recomputed
+ * from the fields. Returns the number of connections written.
+ */
+static int write_room(handoff_writer_t *writer, room_t *room)
+{
+  game_t *game = &room->game;
+  int connections_count = 0;
+  int spectators_count = 0;
+
+  write_le32(writer, room->room_id);
+  write_le64(writer, room->seed);
+  write_u8(writer, room->deck->symbols_per_card);
+  write_u8(writer, room->players_count);
+  write_u8(writer, room->num_players);
+  write_u8(writer, room->ready_players);
+  write_u8(writer, room->has_started);
+  write_le32(writer, room->tick_rate);
+  write_le32(writer, room->worker->worker_id);
+  write_le32(writer, room->actions_count);
+  write_u8(writer, room->journal.is_open);
+
+  if (room->has_started)
+  {
+    write_u8(writer, game->players_count);
+    write_u8(writer, game->current_top_card_index);
+    write_u8(writer, game->has_finished);
+    write_le32(writer, game->used_cards_count);
+    write_bytes(writer, room->deal.card_order, room->deck->cards_count);
+    for (int i = 0; i < game->players_count; i++)
+    {
+      player_state_t *player_state = &game->player_states[i];
+      write_u8(writer, player_state->current_card_index);
+      write_u8(writer, player_state->cards_in_hand_count);
+      write_u8(writer, player_state->swaps_left);
+      write_u8(writer, player_state->swaps_cooldown);
+      write_u8(writer, player_state->freezes_left);
+      write_u8(writer, player_state->freezes_cooldown);
+      write_u8(writer, player_state->rerolls_left);
+      write_u8(writer, player_state->rerolls_cooldown);
+      write_u8(writer, player_state->is_frozen_count);
+    }
+
+    write_le32(writer, room->state_version);
+    write_le32(writer, room->top_card_version);
+    for (int i = 0; i < MAX_GAME_PLAYERS; i++)
+    {
+      write_le32(writer, room->card_versions[i]);
+    }
+    for (int i = 0; i < RECENT_STATES_COUNT; i++)
+    {
+      write_le32(writer, room->recent_board_hashes[i]);
+    }
+
+    write_le32(writer, room->tick_actions_count);
+    for (int i = 0; i < room->tick_actions_count; i++)
+    {
+      room_action_t *tick_action = &room->tick_actions[i];
+      write_u8(writer, tick_action->player_id);
+      write_u8(writer, tick_action->action.action_type);
+      write_le32(writer, tick_action->action.id);
+      write_le32(writer, tick_action->action.board_hash);
+      write_le32(writer, tick_action->action.state_version);
+      write_le64(writer, tick_action->arrived_at);
+    }
+  }
+
+  for (int i = 0; i < room->num_players; i++)
+  {
+    player_t *player = &room->player_list[i];
+    int has_connection = player->connection != NULL && !player->connection->is_broken;
+
+    write_bytes(writer, player->name, MAX_PLAYER_NAME_LENGTH);
+    write_u8(writer, has_connection);
+    if (has_connection)
+    {
+      write_connection(writer, player->connection);
+      connections_count++;
+    }
+  }
+
+  for (int i = 0; i < room->spectators_count; i++)
+  {
+    spectators_count += !room->spectators[i]->is_broken;
+  }
+  write_le32(writer, spectators_count);
+  for (int i = 0; i < room->spectators_count; i++)
+  {
+    if (!room->spectators[i]->is_broken)
+    {
+      write_connection(writer, room->spectators[i]);
+    }
+  }
+
+  return connections_count + spectators_count;
+}
+
+static void read_game(handoff_reader_t *reader, room_t *room)
+{
+  game_t *game = &room->game;
+  const deck_t *deck = room->deck;
+
+  game->deck = deck;
+  game->deal = &room->deal;
+  room->deal.seed = room->seed;
+  game->players_count = read_u8(reader);
+  game->current_top_card_index = read_u8(reader);
+  game->has_finished = read_u8(reader);
+  /* The count keeps growing once the deck wraps, only its range is checked */
+  uint32_t used_cards_count = read_le32(reader);
+  game->used_cards_count = used_cards_count;
+  copy_bytes(reader, room->deal.card_order, deck->cards_count);
+  if (game->players_count > MAX_GAME_PLAYERS || game->current_top_card_index >= deck->cards_count ||
+      used_cards_count > UINT16_MAX)
+  {
+    reader->is_invalid = 1;
+    return;
+  }
+
+  for (int i = 0; i < game->players_count; i++)
+  {
+    player_state_t *player_state = &game->player_states[i];
+    player_state->player_id = i;
+    player_state->current_card_index = read_u8(reader);
+    player_state->cards_in_hand_count = read_u8(reader);
+    player_state->swaps_left = read_u8(reader);
+    player_state->swaps_cooldown = read_u8(reader);
+    player_state->freezes_left = read_u8(reader);
+    player_state->freezes_cooldown = read_u8(reader);
+    player_state->rerolls_left = read_u8(reader);
+    player_state->rerolls_cooldown = read_u8(reader);
+    player_state->is_frozen_count = read_u8(reader);
+    if (player_state->current_card_index >= deck->cards_count)
+    {
+      reader->is_invalid = 1;
+      return;
+    }
+  }
+  reset_board_hash(game);
+
+  room->state_version = read_le32(reader);
+  room->top_card_version = read_le32(reader);
+  for (int i = 0; i < MAX_GAME_PLAYERS; i++)
+  {
+    room->card_versions[i] = read_le32(reader);
+  }
+  for (int i = 0; i < RECENT_STATES_COUNT; i++)
+  {
+    room->recent_board_hashes[i] = read_le32(reader);
+  }
+
+  room->tick_actions_count = read_count(reader, MAX_TICK_ACTIONS);
+  for (int i = 0; i < room->tick_actions_count; i++)
+  {
+    room_action_t *tick_action = &room->tick_actions[i];
+    tick_action->player_id = read_u8(reader);
+    tick_action->action.action_type = read_u8(reader);
+    tick_action->action.id = read_le32(reader);
+    tick_action->action.board_hash = read_le32(reader);
+    tick_action->action.state_version = read_le32(reader);
+    tick_action->arrived_at = read_le64(reader);
+    tick_action->return_code = ERROR;
+    tick_action->trace_id = 0;
+    if (tick_action->player_id >= game->players_count)
+    {
+      reader->is_invalid = 1;
+    }
+  }
+
+  room->broadcast_version = room->state_version;
+  memcpy(&room->broadcast_game, game, sizeof(game_t));
+  memcpy(&room->versioned_game, game, sizeof(game_t));
+}
+
+/*
+ * Recreates a room with its game, versions, seated connections and
+ * spectators. A journaled game goes on appending to the journal under the
+ * same room id, provided this server journals too, which should be to the
+ * same file. Returns the number of connections.
+ */
+static int read_room(server_t *server, handoff_reader_t *reader)
+{
+  room_t *room = create_room(&server->room_manager);
+  int connections_count = 0;
+
+  room->room_id = read_le32(reader);
+  room->seed = read_le64(reader);
+  room->deck = get_deck(read_u8(reader));
+  room->players_count = read_u8(reader);
+  room->num_players = read_u8(reader);
+  room->ready_players = read_u8(reader);
+  room->has_started = read_u8(reader);
+  room->tick_rate = read_le32(reader);
+  room->worker = &server->workers[(uint32_t)read_le32(reader) % server->workers_count];
+  room->actions_count = read_le32(reader);
+  room->journal.is_open = reader->version >= 3 && read_u8(reader) && is_journaling();
+
+  if (room->deck == NULL || room->players_count > MAX_PLAYERS || room->num_players > MAX_PLAYERS ||
+      room->tick_rate < 0 || room->tick_rate > MAX_TICK_RATE)
+  {
+    reader->is_invalid = 1;
+  }
+  if (reader->is_invalid)
+  {
+    return 0;
+  }
+
+  if (room->has_started)
+  {
+    read_game(reader, room);
+  }
+
+  for (int i = 0; i < room->num_players && !reader->is_invalid; i++)
+  {
+    player_t *player = &room->player_list[i];
+
+    copy_bytes(reader, player->name, MAX_PLAYER_NAME_LENGTH);
+    if (!read_u8(reader))
+    {
+      continue;
+    }
+
+    connection_t *connection = read_connection(server, reader);
+    if (connection == NULL)
+    {
+      break;
+    }
+    connection->player_id = i;
+    connection->room = room;
+    player->connection = connection;
+    room->protocol_versions |= PROTOCOL_VERSION_BIT(connection->protocol_version);
+    retain_room(room);
+    connections_count++;
+  }
+
+  int spectators_count = reader->version >= 2 ? read_count(reader, reader->fds_count) : 0;
+  for (int i = 0; i < spectators_count && !reader->is_invalid; i++)
+  {
+    connection_t *connection = read_connection(server, reader);
+    if (connection == NULL)
+    {
+      break;
+    }
+    connection->is_spectator = 1;
+    connection->protocol_version = PROTOCOL_VERSION_FRAMED;
+    connection->room = room;
+    add_room_spectator(room, connection);
+    room->protocol_versions |= PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_FRAMED);
+    retain_room(room);
+    connections_count++;
+  }
+  if (reader->is_invalid)
+  {
+    return connections_count;
+  }
+
+  if (room->has_started)
+  {
+    encode_room_state(room);
+    for (int i = 0; i < room->spectators_count; i++)
+    {
+      send_spectator_state(room, room->spectators[i]);
+    }
+    if (room->tick_rate > 0 && !room->game.has_finished)
+    {
+      start_room_ticker(room);
+    }
+  }
+  __atomic_fetch_add(&room->worker->rooms_count, 1, __ATOMIC_RELAXED);
+  release_room(&server->room_manager, room);
+
+  return connections_count;
+}
+
+static int count_handshaking(connection_t *first)
+{
+  int count = 0;
+
+  for (connection_t *connection = first; connection != NULL; connection = connection->handshake_next)
+  {
+    count += !connection->is_broken;
+  }
+
+  return count;
+}
+
+static void write_handshaking(handoff_writer_t *writer, connection_t *first)
+{
+  for (connection_t *connection = first; connection != NULL; connection = connection->handshake_next)
+  {
+    if (!connection->is_broken)
+    {
+      write_connection(writer, connection);
+    }
+  }
+}
+
+/*
+ * Serializes everything the workers own. Only called while every worker
+ * is parked, so nothing changes underneath.
+ */
+static void write_server_state(server_t *server, handoff_writer_t *writer, int *rooms_count, int *connections_count)
+{
+  int waiting_count = 0;
+  int handshaking_count = 0;
+  long long matched_count = 0;
+
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    matched_count += server->workers[i].lobby.matched_count;
+  }
+  write_le32(writer, server->room_manager.next_room_id);
+  write_le64(writer, server->room_manager.seed_base);
+  write_le64(writer, matched_count);
+
+  write_le32(writer, server->workers_count);
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    write_fd(writer, server->workers[i].listen_fd);
+  }
+
+  pthread_mutex_lock(&server->room_manager.mutex);
+  *rooms_count = 0;
+  *connections_count = 0;
+  for (room_t *room = server->room_manager.rooms; room != NULL; room = room->next)
+  {
+    *rooms_count += has_live_connections(room);
+  }
+  write_le32(writer, *rooms_count);
+  for (room_t *room = server->room_manager.rooms; room != NULL; room = room->next)
+  {
+    if (has_live_connections(room))
+    {
+      *connections_count += write_room(writer, room);
+    }
+  }
+  pthread_mutex_unlock(&server->room_manager.mutex);
+
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    for (connection_t *connection = server->workers[i].lobby.first; connection != NULL;
+         connection = connection->lobby_next)
+    {
+      waiting_count += !connection->is_broken;
+    }
+  }
+  write_le32(writer, waiting_count);
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    for (connection_t *connection = server->workers[i].lobby.first; connection != NULL;
+         connection = connection->lobby_next)
+    {
+      if (!connection->is_broken)
+      {
+        write_connection(writer, connection);
+      }
+    }
+  }
+
+  /* Handed over connections are still handshaking, on their new worker. */
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    handshaking_count += count_handshaking(server->workers[i].handshaking);
+    handshaking_count += count_handshaking(server->workers[i].handed_over);
+  }
+  write_le32(writer, handshaking_count);
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    write_handshaking(writer, server->workers[i].handshaking);
+    write_handshaking(writer, server->workers[i].handed_over);
+  }
+
+  *connections_count += waiting_count + handshaking_count;
+}
+
+/*
+ * Listeners keep their worker index. Listeners of workers this server does
+ * not run are closed, which resets the connections in their backlog.
+ */
+static void adopt_listener(server_t *server, int index, int listen_fd)
+{
+  if (index >= server->workers_count)
+  {
+    LOG_WARN("Closing the listener of worker %d, which this server does not run\n", index);
+    close(listen_fd);
+    return;
+  }
+
+  server->workers[index].listen_fd = listen_fd;
+  register_listener(&server->workers[index]);
+}
+
+static void read_server_state(server_t *server, handoff_reader_t *reader, int *rooms_count, int *connections_count)
+{
+  int next_room_id = read_le32(reader);
+  uint64_t seed_base = read_le64(reader);
+
+  /* Matches are counted per worker, the first one carries the total. */
+  server->workers[0].lobby.matched_count = read_le64(reader);
+
+  int listeners_count = read_count(reader, reader->fds_count);
+  for (int i = 0; i < listeners_count && !reader->is_invalid; i++)
+  {
+    int listen_fd = read_fd(reader);
+    if (listen_fd >= 0)
+    {
+      adopt_listener(server, i, listen_fd);
+    }
+  }
+
+  *rooms_count = read_count(reader, reader->fds_count);
+  *connections_count = 0;
+  for (int i = 0; i < *rooms_count && !reader->is_invalid; i++)
+  {
+    *connections_count += read_room(server, reader);
+  }
+  server->room_manager.next_room_id = next_room_id;
+  server->room_manager.seed_base = seed_base;
+
+  int waiting_count = read_count(reader, reader->fds_count);
+  for (int i = 0; i < waiting_count && !reader->is_invalid; i++)
+  {
+    connection_t *connection = read_connection(server, reader);
+    if (connection != NULL)
+    {
+      add_waiting_connection(&connection->worker->lobby, connection);
+      (*connections_count)++;
+    }
+  }
+
+  /* Each is adopted on its first event, which parses a hello it holds. */
+  int handshaking_count = read_count(reader, reader->fds_count);
+  for (int i = 0; i < handshaking_count && !reader->is_invalid; i++)
+  {
+    connection_t *connection = read_connection(server, reader);
+    if (connection != NULL)
+    {
+      add_handed_over_connection(connection->worker, connection);
+      (*connections_count)++;
+    }
+  }
+}
+
+static int send_all(int socket_fd, const void *data, int length)
+{
+  const char *bytes = (const char *)data;
+
+  while (length > 0)
+  {
+    int sent = send(socket_fd, bytes, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (sent <= 0)
+    {
+      return -1;
+    }
+    bytes += sent;
+    length -= sent;
+  }
+
+  return 0;
+}
+
+static int receive_all(int socket_fd, void *data, int length)
+{
+  char *bytes = (char *)data;
+
+  while (length > 0)
+  {
+    int received = recv(socket_fd, bytes, length, 0);
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (received <= 0)
+    {
+      return -1;
+    }
+    bytes += received;
+    length -= received;
+  }
+
+  return 0;
+}
+
+/*
+ * Every batch of descriptors rides on a single byte of its own, so the
+ * receiver never gets descriptors of two batches in one read.
+ */
+static int send_fds(int socket_fd, const int *fds, int count)
+{
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS_PER_MESSAGE * sizeof(int))];
+
+  for (int offset = 0; offset < count; offset += HANDOFF_MAX_FDS_PER_MESSAGE)
+  {
+    int batch = count - offset < HANDOFF_MAX_FDS_PER_MESSAGE ? count - offset : HANDOFF_MAX_FDS_PER_MESSAGE;
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(batch * sizeof(int));
+    memcpy(CMSG_DATA(header), fds + offset, batch * sizeof(int));
+
+    if (sendmsg(socket_fd, &message, MSG_NOSIGNAL) != 1)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int receive_fds(int socket_fd, int *fds, int count)
+{
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS_PER_MESSAGE * sizeof(int))];
+
+  for (int offset = 0; offset < count; offset += HANDOFF_MAX_FDS_PER_MESSAGE)
+  {
+    int batch = count - offset < HANDOFF_MAX_FDS_PER_MESSAGE ? count - offset : HANDOFF_MAX_FDS_PER_MESSAGE;
+    char byte;
+    struct iovec iov = {&byte, 1};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    if (recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC) != 1 || (message.msg_flags & MSG_CTRUNC))
+    {
+      return -1;
+    }
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(batch * sizeof(int)))
+    {
+      return -1;
+    }
+    memcpy(fds + offset, CMSG_DATA(header), batch * sizeof(int));
+  }
+
+  return 0;
+}
+
+static void set_handoff_timeouts(int socket_fd)
+{
+  struct timeval timeout = {HANDOFF_TIMEOUT_SECONDS, 0};
+
+  setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static void fail_handoff(const char *message)
+{
+  fprintf(stderr, "Handoff failed: %s\n", message);
+  exit(1);
+}
+
+/*
+ * Takes over from the server listening on the handoff path, if there is
+ * one. Called before the workers start. Anything wrong with the state
+ * received is fatal, the other server then carries on.
+ */
+int receive_handoff(server_t *server)
+{
+  const char *path = server->config.handoff_path;
+  struct sockaddr_un address;
+  uint8_t header[HANDOFF_HEADER_SIZE];
+  int rooms_count;
+  int connections_count;
+
+  if (path == NULL || strlen(path) >= sizeof(address.sun_path))
+  {
+    return 0;
+  }
+
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd < 0)
+  {
+    perror("handoff socket failed");
+    exit(1);
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close(socket_fd);
+    return 0;
+  }
+  set_handoff_timeouts(socket_fd);
+
+  uint64_t started_at = stats_now_ns();
+  if (receive_all(socket_fd, header, sizeof(header)) < 0)
+  {
+    fail_handoff("no state received");
+  }
+
+  handoff_reader_t header_reader = {header, sizeof(header), 0, NULL, 0, 0, 0};
+  const uint8_t *magic = read_bytes(&header_reader, HANDOFF_MAGIC_SIZE);
+  int version = read_u8(&header_reader);
+  int data_length = read_le32(&header_reader);
+  int fds_count = read_le32(&header_reader);
+  if (memcmp(magic, HANDOFF_MAGIC, HANDOFF_MAGIC_SIZE) != 0 || version < 1 || version > HANDOFF_VERSION ||
+      data_length < 0 || fds_count < 0)
+  {
+    fail_handoff("unknown state format");
+  }
+
+  int *fds = (int *)malloc((fds_count > 0 ? fds_count : 1) * sizeof(int));
+  uint8_t *data = (uint8_t *)malloc(data_length > 0 ? data_length : 1);
+  if (fds == NULL || data == NULL)
+  {
+    perror("handoff malloc failed");
+    exit(1);
+  }
+  if (receive_fds(socket_fd, fds, fds_count) < 0 || receive_all(socket_fd, data, data_length) < 0)
+  {
+    fail_handoff("state cut short");
+  }
+
+  handoff_reader_t reader = {data, data_length, 0, fds, fds_count, version, 0};
+  read_server_state(server, &reader, &rooms_count, &connections_count);
+  if (reader.is_invalid || reader.offset != reader.length)
+  {
+    fail_handoff("invalid state");
+  }
+
+  char confirmation = 1;
+  if (send_all(socket_fd, &confirmation, 1) < 0)
+  {
+    fail_handoff("could not confirm the takeover");
+  }
+  close(socket_fd);
+  free(data);
+  free(fds);
+
+  LOG_INFO("Took over %d rooms and %d connections in %d us\n", rooms_count, connections_count,
+           (stats_now_ns() - started_at) / 1000);
+  return 1;
+}
+
+/*
+ * The newer server carries on with the journals of the games it took
+ * over. Only the games left behind because everybody had left end here.
+ */
+static void finish_handoff(server_t *server)
+{
+  pthread_mutex_lock(&server->room_manager.mutex);
+  for (room_t *room = server->room_manager.rooms; room != NULL; room = room->next)
+  {
+    if (!has_live_connections(room))
+    {
+      close_room_journal(room);
+    }
+  }
+  pthread_mutex_unlock(&server->room_manager.mutex);
+
+  stop_journal();
+  stop_tracing();
+  stop_logger();
+  exit(0);
+}
+
+/*
+ * Parks the workers, sends everything to the newer server and exits once
+ * it confirms. When it does not, the workers resume as if nothing had
+ * happened.
+ */
+static void hand_off(server_t *server, int socket_fd)
+{
+  handoff_writer_t writer;
+  uint8_t header[HANDOFF_HEADER_SIZE];
+  uint64_t wake_up = 1;
+  char confirmation;
+  int rooms_count;
+  int connections_count;
+  uint64_t started_at = stats_now_ns();
+
+  if (write(server->handoff_fd, &wake_up, sizeof(wake_up)) != sizeof(wake_up))
+  {
+    perror("handoff eventfd write failed");
+    return;
+  }
+  pthread_barrier_wait(&server->handoff_barrier);
+
+  /* Records of the rooms must be in the journal before the newer server appends to it */
+  flush_room_journals(server);
+  sync_journal();
+
+  memset(&writer, 0, sizeof(writer));
+  init_message_buffer(&writer.data);
+  write_server_state(server, &writer, &rooms_count, &connections_count);
+
+  handoff_writer_t header_writer;
+  memset(&header_writer, 0, sizeof(header_writer));
+  init_message_buffer(&header_writer.data);
+  write_bytes(&header_writer, HANDOFF_MAGIC, HANDOFF_MAGIC_SIZE);
+  write_u8(&header_writer, HANDOFF_VERSION);
+  write_le32(&header_writer, writer.data.length);
+  write_le32(&header_writer, writer.fds_count);
+  memcpy(header, header_writer.data.data, sizeof(header));
+  destroy_message_buffer(&header_writer.data);
+
+  int is_taken_over = send_all(socket_fd, header, sizeof(header)) == 0 &&
+                      send_fds(socket_fd, writer.fds, writer.fds_count) == 0 &&
+                      send_all(socket_fd, writer.data.data, writer.data.length) == 0 &&
+                      receive_all(socket_fd, &confirmation, 1) == 0;
+  destroy_message_buffer(&writer.data);
+  free(writer.fds);
+
+  if (is_taken_over)
+  {
+    LOG_INFO("Handed %d rooms and %d connections over, players were paused for %d us\n", rooms_count,
+             connections_count, (stats_now_ns() - started_at) / 1000);
+    finish_handoff(server);
+  }
+
+  LOG_WARN("Handoff of %d rooms was not confirmed, resuming\n", rooms_count);
+  if (read(server->handoff_fd, &wake_up, sizeof(wake_up)) != sizeof(wake_up))
+  {
+    perror("handoff eventfd read failed");
+  }
+  pthread_barrier_wait(&server->handoff_barrier);
+}
+
+static void *run_handoff_listener(void *arg)
+{
+  server_t *server = (server_t *)arg;
+
+  while (1)
+  {
+    int socket_fd = accept4(server->handoff_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (socket_fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+      {
+        continue;
+      }
+      perror("handoff accept failed");
+      return NULL;
+    }
+
+    set_handoff_timeouts(socket_fd);
+    hand_off(server, socket_fd);
+    close(socket_fd);
+  }
+}
+
+/*
+ * Workers stop at the first barrier until the handoff has the state to
+ * itself and wait at the second one for it to fail.
+ */
+void park_worker_for_handoff(server_t *server)
+{
+  pthread_barrier_wait(&server->handoff_barrier);
+  pthread_barrier_wait(&server->handoff_barrier);
+}
+
+/*
+ * Listens for a newer server on the handoff path. An eventfd polled by
+ * every worker wakes them up to park when one connects.
+ */
+void start_handoff_listener(server_t *server)
+{
+  const char *path = server->config.handoff_path;
+  struct sockaddr_un address;
+  struct epoll_event event;
+
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Handoff path %s is too long\n", path);
+    exit(1);
+  }
+
+  if ((server->handoff_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    perror("eventfd failed");
+    exit(1);
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = &server->handoff_source;
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    if (epoll_ctl(server->workers[i].epoll_fd, EPOLL_CTL_ADD, server->handoff_fd, &event) < 0)
+    {
+      perror("epoll_ctl failed");
+      exit(1);
+    }
+  }
+  if (pthread_barrier_init(&server->handoff_barrier, NULL, server->workers_count + 1) != 0)
+  {
+    perror("handoff barrier init failed");
+    exit(1);
+  }
+
+  if ((server->handoff_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("handoff socket failed");
+    exit(1);
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  unlink(path);
+  if (bind(server->handoff_listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(server->handoff_listen_fd, 1) < 0)
+  {
+    perror("handoff bind failed");
+    exit(1);
+  }
+
+  if (pthread_create(&server->handoff_thread, NULL, run_handoff_listener, server) != 0)
+  {
+    perror("handoff pthread_create failed");
+    exit(1);
+  }
+  LOG_INFO("Waiting for a newer server to hand off to\n");
+}
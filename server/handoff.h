@@ -0,0 +1,34 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "server.h"
+
+#define HANDOFF_MAGIC "DOBH"
+#define HANDOFF_MAGIC_SIZE 4
+#define HANDOFF_VERSION 3
+#define HANDOFF_HEADER_SIZE (HANDOFF_MAGIC_SIZE + 9)
+#define HANDOFF_MAX_FDS_PER_MESSAGE 250
+#define HANDOFF_TIMEOUT_SECONDS 5
+
+/*
+ * A server started with a handoff path listens on a Unix socket there. A
+ * newer server started with the same path connects to it before opening
+ * its own listeners, and the running server stops its workers, sends the
+ * state of every room and connection followed by the listening and player
+ * sockets with SCM_RIGHTS, and exits once the newer server confirms it
+ * has taken over. Clients keep their connections and never notice more
+ * than the pause.
+ *
+ * The state is a header (magic, version, little-endian uint32 lengths of
+ * the data and of the fd list) and little-endian fields, with sockets
+ * referred to by their index in the fd list. Version 2 adds the
+ * spectators of every room and version 3 whether its game is journaled.
+ * Older states are still taken over.
+ */
+int receive_handoff(server_t *server);
+
+void start_handoff_listener(server_t *server);
+
+void park_worker_for_handoff(server_t *server);
+
+#endif
@@ -0,0 +1,324 @@
+#include "journal.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define JOURNAL_WRITER_IDLE_NANOSECONDS 1000000L
+
+static mpsc_queue_t chunks;
+static int pending_chunks_count;
+static FILE *journal_file;
+static pthread_t writer_thread;
+static int is_writer_running;
+
+static void put_le32(uint8_t *buffer, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    buffer[i] = value >> (8 * i);
+  }
+}
+
+static void put_le64(uint8_t *buffer, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    buffer[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t get_le32(const uint8_t *buffer)
+{
+  uint32_t value = 0;
+
+  for (int i = 0; i < 4; i++)
+  {
+    value |= (uint32_t)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+static uint64_t get_le64(const uint8_t *buffer)
+{
+  uint64_t value = 0;
+
+  for (int i = 0; i < 8; i++)
+  {
+    value |= (uint64_t)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+/*
+ * Writes the record to the buffer, which must hold at least
+ * MAX_JOURNAL_RECORD_SIZE bytes. Returns the number of bytes.
+ */
+int encode_journal_record(const journal_record_t *record, uint8_t *buffer)
+{
+  buffer[0] = record->record_type;
+  put_le32(buffer + 1, record->room_id);
+  put_le64(buffer + 5, record->timestamp_ns);
+  uint8_t *payload = buffer + JOURNAL_ROOM_HEADER_SIZE;
+
+  switch (record->record_type)
+  {
+  case ROOM_STARTED:
+    put_le64(payload, record->payload.started.seed);
+    payload[8] = record->payload.started.symbols_per_card;
+    payload[9] = record->payload.started.players_count;
+    payload[10] = record->payload.started.cards_count;
+    memcpy(payload + 11, record->payload.started.card_order, record->payload.started.cards_count);
+    return JOURNAL_ROOM_STARTED_SIZE + record->payload.started.cards_count;
+  case ACTION_MADE:
+    payload[0] = record->payload.action.player_id;
+    payload[1] = record->payload.action.return_code;
+    payload[2] = record->payload.action.action_type;
+    put_le32(payload + 3, record->payload.action.id);
+    return JOURNAL_ACTION_SIZE;
+  case ROOM_FINISHED:
+    put_le32(payload, record->payload.finished.board_hash);
+    payload[4] = record->payload.finished.has_finished;
+    return JOURNAL_ROOM_FINISHED_SIZE;
+  }
+
+  return 0;
+}
+
+/*
+ * Parses the record at the start of the buffer. The card order of a
+ * started room points into the buffer. Returns the number of bytes
+ * consumed, 0 when the record is incomplete and -1 when it is invalid.
+ */
+int decode_journal_record(const uint8_t *buffer, int length, journal_record_t *record)
+{
+  if (length < JOURNAL_ROOM_HEADER_SIZE)
+  {
+    return 0;
+  }
+
+  record->record_type = buffer[0];
+  record->room_id = get_le32(buffer + 1);
+  record->timestamp_ns = get_le64(buffer + 5);
+  const uint8_t *payload = buffer + JOURNAL_ROOM_HEADER_SIZE;
+
+  switch (record->record_type)
+  {
+  case ROOM_STARTED:
+    if (length < JOURNAL_ROOM_STARTED_SIZE || length < JOURNAL_ROOM_STARTED_SIZE + payload[10])
+    {
+      return 0;
+    }
+    record->payload.started.seed = get_le64(payload);
+    record->payload.started.symbols_per_card = payload[8];
+    record->payload.started.players_count = payload[9];
+    record->payload.started.cards_count = payload[10];
+    record->payload.started.card_order = payload + 11;
+    return JOURNAL_ROOM_STARTED_SIZE + payload[10];
+  case ACTION_MADE:
+    if (length < JOURNAL_ACTION_SIZE)
+    {
+      return 0;
+    }
+    record->payload.action.player_id = payload[0];
+    record->payload.action.return_code = payload[1];
+    record->payload.action.action_type = payload[2];
+    record->payload.action.id = (int32_t)get_le32(payload + 3);
+    return JOURNAL_ACTION_SIZE;
+  case ROOM_FINISHED:
+    if (length < JOURNAL_ROOM_FINISHED_SIZE)
+    {
+      return 0;
+    }
+    record->payload.finished.board_hash = (int32_t)get_le32(payload);
+    record->payload.finished.has_finished = payload[4];
+    return JOURNAL_ROOM_FINISHED_SIZE;
+  }
+
+  return -1;
+}
+
+/*
+ * Writes every chunk handed over so far. Returns how many there were.
+ */
+static int write_journal_chunks(void)
+{
+  int written = 0;
+
+  while (__atomic_load_n(&pending_chunks_count, __ATOMIC_ACQUIRE) > 0)
+  {
+    journal_chunk_t *chunk = (journal_chunk_t *)mpsc_queue_pop(&chunks);
+    if (chunk == NULL)
+    {
+      continue;
+    }
+
+    if (fwrite(chunk->data, 1, chunk->length, journal_file) != (size_t)chunk->length)
+    {
+      perror("journal fwrite failed");
+      exit(1);
+    }
+    free(chunk);
+    __atomic_fetch_sub(&pending_chunks_count, 1, __ATOMIC_RELEASE);
+    written++;
+  }
+
+  return written;
+}
+
+static void *run_journal_writer(void *arg)
+{
+  struct timespec idle = {0, JOURNAL_WRITER_IDLE_NANOSECONDS};
+
+  (void)arg;
+
+  while (1)
+  {
+    int is_running = __atomic_load_n(&is_writer_running, __ATOMIC_ACQUIRE);
+
+    if (write_journal_chunks() > 0)
+    {
+      fflush(journal_file);
+    }
+    else if (!is_running)
+    {
+      break;
+    }
+    else
+    {
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * A server taking over from an older one appends to the same journal and
+ * carries on with the games it took over under their room ids. The file
+ * is unbuffered so every chunk is a single O_APPEND write that cannot
+ * interleave with the chunks the older server writes while it shuts down.
+ */
+void start_journal(const char *path)
+{
+  journal_file = fopen(path, "ab");
+  if (journal_file == NULL)
+  {
+    perror("journal fopen failed");
+    exit(1);
+  }
+  setvbuf(journal_file, NULL, _IONBF, 0);
+  if (fseek(journal_file, 0, SEEK_END) != 0)
+  {
+    perror("journal fseek failed");
+    exit(1);
+  }
+
+  if (ftell(journal_file) == 0)
+  {
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+    header[JOURNAL_MAGIC_SIZE] = JOURNAL_VERSION;
+    if (fwrite(header, 1, sizeof(header), journal_file) != sizeof(header))
+    {
+      perror("journal fwrite failed");
+      exit(1);
+    }
+  }
+
+  init_mpsc_queue(&chunks);
+  __atomic_store_n(&is_writer_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&writer_thread, NULL, run_journal_writer, NULL) != 0)
+  {
+    perror("journal writer pthread_create failed");
+    exit(1);
+  }
+}
+
+int is_journaling(void)
+{
+  return journal_file != NULL;
+}
+
+static void hand_over_chunk(room_journal_t *journal)
+{
+  journal_chunk_t *chunk = journal->chunk;
+
+  if (chunk == NULL)
+  {
+    return;
+  }
+
+  journal->chunk = NULL;
+  __atomic_fetch_add(&pending_chunks_count, 1, __ATOMIC_RELEASE);
+  mpsc_queue_push(&chunks, &chunk->node);
+}
+
+/*
+ * Hands the room's chunk to the writer thread. The next record starts a
+ * new one. Besides the room, the periodic flush calls this from the main
+ * thread, hence the lock.
+ */
+void flush_room_journal(room_journal_t *journal)
+{
+  pthread_mutex_lock(&journal->mutex);
+  hand_over_chunk(journal);
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+/*
+ * Called only by the thread currently running the room. The lock is only
+ * ever contended by the periodic flush.
+ */
+void append_journal_record(room_journal_t *journal, const journal_record_t *record)
+{
+  pthread_mutex_lock(&journal->mutex);
+  if (journal->chunk != NULL && journal->chunk->length + MAX_JOURNAL_RECORD_SIZE > JOURNAL_CHUNK_SIZE)
+  {
+    hand_over_chunk(journal);
+  }
+  if (journal->chunk == NULL)
+  {
+    journal->chunk = (journal_chunk_t *)malloc(sizeof(journal_chunk_t));
+    if (journal->chunk == NULL)
+    {
+      perror("journal chunk malloc failed");
+      exit(1);
+    }
+    journal->chunk->length = 0;
+  }
+
+  journal->chunk->length += encode_journal_record(record, journal->chunk->data + journal->chunk->length);
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+/*
+ * Waits until every chunk handed over so far is in the file.
+ */
+void sync_journal(void)
+{
+  struct timespec idle = {0, JOURNAL_WRITER_IDLE_NANOSECONDS};
+
+  while (journal_file != NULL && __atomic_load_n(&pending_chunks_count, __ATOMIC_ACQUIRE) > 0)
+  {
+    nanosleep(&idle, NULL);
+  }
+}
+
+/*
+ * Stops the writer once every chunk handed over so far has been written.
+ * Chunks rooms still hold are not part of the journal.
+ */
+void stop_journal(void)
+{
+  if (journal_file == NULL)
+  {
+    return;
+  }
+
+  __atomic_store_n(&is_writer_running, 0, __ATOMIC_RELEASE);
+  pthread_join(writer_thread, NULL);
+  fclose(journal_file);
+  journal_file = NULL;
+}
@@ -0,0 +1,112 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "game.h"
+#include "mpsc_queue.h"
+
+#define JOURNAL_MAGIC "DOBJ"
+#define JOURNAL_MAGIC_SIZE 4
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE (JOURNAL_MAGIC_SIZE + 1)
+#define JOURNAL_CHUNK_SIZE 4096
+#define JOURNAL_ROOM_HEADER_SIZE 13
+#define JOURNAL_ROOM_STARTED_SIZE (JOURNAL_ROOM_HEADER_SIZE + 11)
+#define JOURNAL_ACTION_SIZE (JOURNAL_ROOM_HEADER_SIZE + 7)
+#define JOURNAL_ROOM_FINISHED_SIZE (JOURNAL_ROOM_HEADER_SIZE + 5)
+#define MAX_JOURNAL_RECORD_SIZE (JOURNAL_ROOM_STARTED_SIZE + MAX_DECK_CARDS)
+
+/*
+ * The journal is one append-only file shared by a server and the ones it
+ * hands off to. After the header,
+ * the records of all rooms are interleaved, each starting with its type
+ * byte, the little-endian uint32 room id and uint64 monotonic timestamp.
+ * A room's records always appear in the order the room made them.
+ */
+typedef enum journal_record_type
+{
+  ROOM_STARTED,
+  ACTION_MADE,
+  ROOM_FINISHED
+} journal_record_type_t;
+
+/*
+ * ROOM_STARTED carries everything the deal depends on: the seed, the
+ * deck size, the seat count and the shuffled card order it produced.
+ * ACTION_MADE carries an action that reached the game with the return
+ * code it got, and ROOM_FINISHED the final board hash.
+ *
+ * Stale actions, rejected before act_player saw them, are not journaled.
+ * Actions act_player rejected are, at 20 bytes each: a wrong guess still
+ * advances every cooldown and freeze, so replay must feed it through
+ * act_player to reach the same state.
+ */
+typedef struct
+{
+  journal_record_type_t record_type;
+  uint32_t room_id;
+  uint64_t timestamp_ns;
+  union
+  {
+    struct
+    {
+      uint64_t seed;
+      uint8_t symbols_per_card;
+      uint8_t players_count;
+      uint8_t cards_count;
+      const uint8_t *card_order;
+    } started;
+    struct
+    {
+      uint8_t player_id;
+      uint8_t return_code;
+      uint8_t action_type;
+      int32_t id;
+    } action;
+    struct
+    {
+      int32_t board_hash;
+      uint8_t has_finished;
+    } finished;
+  } payload;
+} journal_record_t;
+
+/*
+ * Records of one room are encoded into its current chunk, which goes to
+ * the writer thread when it is full or the room finishes, so a room never
+ * waits for the disk and the writer sees a few large writes. The server
+ * also hands partial chunks over every second, so a crash loses at most
+ * that much of a running game.
+ */
+typedef struct
+{
+  queue_node_t node;
+  int length;
+  uint8_t data[JOURNAL_CHUNK_SIZE];
+} journal_chunk_t;
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  journal_chunk_t *chunk;
+  int is_open;
+} room_journal_t;
+
+int encode_journal_record(const journal_record_t *record, uint8_t *buffer);
+
+int decode_journal_record(const uint8_t *buffer, int length, journal_record_t *record);
+
+void start_journal(const char *path);
+
+int is_journaling(void);
+
+void append_journal_record(room_journal_t *journal, const journal_record_t *record);
+
+void flush_room_journal(room_journal_t *journal);
+
+void sync_journal(void);
+
+void stop_journal(void);
+
+#endif
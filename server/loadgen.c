@@ -0,0 +1,1161 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "room.h"
+
+#define LOADGEN_INPUT_BUFFER_SIZE 4096
+#define MAX_EPOLL_EVENTS_PER_WAIT 256
+#define LOADGEN_COUNTERS_COUNT 8
+#define LOADGEN_TIMESTAMP_BITS 48
+#define LOADGEN_TIMESTAMP_MASK (((uint64_t)1 << LOADGEN_TIMESTAMP_BITS) - 1)
+#define SPECTATOR_RETRY_NANOSECONDS 10000000ULL
+
+typedef struct
+{
+  const char *host;
+  int port;
+  int connections_count;
+  int threads_count;
+  double actions_per_second;
+  int duration_seconds;
+  int protocol_version;
+  int spectators_count;
+  int watched_rooms_count;
+} loadgen_config_t;
+
+typedef struct
+{
+  uint64_t *values;
+  size_t length;
+  size_t capacity;
+} samples_t;
+
+/*
+ * One simulated player or spectator. The last state received from the
+ * server is kept decoded so the bot can compute the board hash and the
+ * matching symbol. A spectator watches a room by id and asks again until
+ * the room exists.
+ */
+typedef struct bot_connection
+{
+  int index;
+  int is_spectator;
+  int watched_room_id;
+  uint64_t reconnect_at;
+  int sockfd;
+  int is_connected;
+  int is_closed;
+  int has_communication_metadata;
+  int has_state;
+  int player_id;
+  int symbols_per_card;
+  int players_count;
+  int top_card[MAX_SYMBOLS_PER_CARD];
+  int cards[MAX_GAME_PLAYERS][MAX_SYMBOLS_PER_CARD];
+  int counters[MAX_GAME_PLAYERS][LOADGEN_COUNTERS_COUNT];
+  int peers[MAX_GAME_PLAYERS];
+  int action_pending;
+  uint32_t state_version;
+  uint64_t connect_started_at;
+  uint64_t first_state_at;
+  uint64_t action_sent_at;
+  uint64_t next_action_at;
+  uint64_t played_card;
+  int input_length;
+  char input[LOADGEN_INPUT_BUFFER_SIZE];
+} bot_connection_t;
+
+typedef struct
+{
+  int worker_id;
+  int epoll_fd;
+  pthread_t thread;
+  bot_connection_t *connections;
+  int connections_count;
+  int open_connections_count;
+  int reconnecting_count;
+  samples_t connect_latencies;
+  samples_t round_trips;
+  samples_t fan_out_delays;
+  samples_t spectator_fan_out_delays;
+  long long actions_count;
+  long long games_count;
+  long long spectated_games_count;
+  long long spectator_updates_count;
+  long long spectator_update_bytes;
+  long long failed_connections_count;
+  long long resyncs_count;
+  long long state_updates_count;
+  long long state_update_bytes;
+  long long return_codes[RETURN_CODES_COUNT];
+} loadgen_worker_t;
+
+static loadgen_config_t config;
+static struct sockaddr_in server_address;
+static bot_connection_t *all_connections;
+static uint64_t started_at;
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void add_sample(samples_t *samples, uint64_t value)
+{
+  if (samples->length == samples->capacity)
+  {
+    samples->capacity = samples->capacity == 0 ? 1024 : samples->capacity * 2;
+    samples->values = (uint64_t *)realloc(samples->values, samples->capacity * sizeof(uint64_t));
+    if (samples->values == NULL)
+    {
+      perror("samples realloc failed");
+      exit(1);
+    }
+  }
+  samples->values[samples->length++] = value;
+}
+
+static void merge_samples(samples_t *destination, samples_t *source)
+{
+  for (size_t i = 0; i < source->length; i++)
+  {
+    add_sample(destination, source->values[i]);
+  }
+  free(source->values);
+}
+
+static int compare_samples(const void *first, const void *second)
+{
+  uint64_t a = *(const uint64_t *)first;
+  uint64_t b = *(const uint64_t *)second;
+  return (a > b) - (a < b);
+}
+
+static void print_samples(const char *label, samples_t *samples)
+{
+  if (samples->length == 0)
+  {
+    printf("%-18s no samples\n", label);
+    return;
+  }
+
+  qsort(samples->values, samples->length, sizeof(uint64_t), compare_samples);
+  printf("%-18s n=%zu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", label, samples->length,
+         samples->values[samples->length * 50 / 100] / 1e3, samples->values[samples->length * 99 / 100] / 1e3,
+         samples->values[samples->length * 999 / 1000] / 1e3, samples->values[samples->length - 1] / 1e3);
+}
+
+static int read_int(const char *buffer, int offset)
+{
+  int value;
+  memcpy(&value, buffer + offset, sizeof(int));
+  return value;
+}
+
+/*
+ * Identifies a card by its first two symbols, which no other card of a
+ * projective plane shares.
+ */
+static uint64_t card_key(const int *card)
+{
+  return ((uint64_t)card[0] << 8) | (uint64_t)card[1];
+}
+
+static int calculate_bot_board_hash(bot_connection_t *bot)
+{
+  static const int counter_weights[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+  int check_sum = 0;
+
+  for (int i = 0; i < bot->symbols_per_card; i++)
+  {
+    check_sum = (check_sum + bot->top_card[i] * (i + 1)) % CHECKSUM_MODULO;
+  }
+  for (int i = 0; i < bot->players_count; i++)
+  {
+    for (int j = 0; j < bot->symbols_per_card; j++)
+    {
+      check_sum = (check_sum + bot->cards[i][j] * (i + 1) * (j + 1)) % CHECKSUM_MODULO;
+    }
+  }
+  for (int i = 0; i < bot->players_count; i++)
+  {
+    for (int j = 0; j < 6; j++)
+    {
+      check_sum += (bot->counters[i][j + 1] * (i + 1) * counter_weights[j]) % CHECKSUM_MODULO;
+    }
+  }
+
+  return check_sum;
+}
+
+/*
+ * Measures fan-out on every state that moved a peer's card to the top:
+ * the delay from that peer sending the action to this bot receiving it.
+ */
+static void record_fan_out(loadgen_worker_t *worker, bot_connection_t *bot, const int *new_top_card, uint64_t received_at)
+{
+  uint64_t new_top_key = card_key(new_top_card);
+
+  if (!bot->has_state || new_top_key == card_key(bot->top_card))
+  {
+    return;
+  }
+
+  for (int i = 0; i < bot->players_count; i++)
+  {
+    if (i == bot->player_id || card_key(bot->cards[i]) != new_top_key || bot->peers[i] < 0)
+    {
+      continue;
+    }
+
+    uint64_t played_card = __atomic_load_n(&all_connections[bot->peers[i]].played_card, __ATOMIC_ACQUIRE);
+    if (played_card >> LOADGEN_TIMESTAMP_BITS == new_top_key)
+    {
+      uint64_t sent_at = started_at + (played_card & LOADGEN_TIMESTAMP_MASK);
+      add_sample(bot->is_spectator ? &worker->spectator_fan_out_delays : &worker->fan_out_delays, received_at - sent_at);
+    }
+    return;
+  }
+}
+
+/*
+ * The first state a bot receives means the server seated it in a game.
+ */
+static void mark_state_received(bot_connection_t *bot)
+{
+  if (bot->first_state_at == 0)
+  {
+    bot->first_state_at = now_ns();
+  }
+  bot->has_state = 1;
+}
+
+static int parse_game_state(loadgen_worker_t *worker, bot_connection_t *bot, const char *buffer, int length, uint64_t received_at)
+{
+  int offset = PROTOCOL_INT_SIZE;
+  int top_card[MAX_SYMBOLS_PER_CARD];
+
+  if (length < offset + PROTOCOL_INT_SIZE)
+  {
+    return 0;
+  }
+  int symbols_per_card = read_int(buffer, offset);
+  int card_size = symbols_per_card * PROTOCOL_INT_SIZE;
+  int player_size = PROTOCOL_INT_SIZE + MAX_PLAYER_NAME_LENGTH + card_size + LOADGEN_COUNTERS_COUNT * PROTOCOL_INT_SIZE;
+  offset += PROTOCOL_INT_SIZE;
+
+  if (symbols_per_card < 2 || symbols_per_card > MAX_SYMBOLS_PER_CARD)
+  {
+    return -1;
+  }
+  if (length < offset + card_size + PROTOCOL_INT_SIZE)
+  {
+    return 0;
+  }
+  int players_count = read_int(buffer, offset + card_size);
+  if (players_count < 0 || players_count > MAX_GAME_PLAYERS)
+  {
+    return -1;
+  }
+  if (length < offset + card_size + PROTOCOL_INT_SIZE + players_count * player_size + PROTOCOL_INT_SIZE)
+  {
+    return 0;
+  }
+
+  memcpy(top_card, buffer + offset, card_size);
+  record_fan_out(worker, bot, top_card, received_at);
+  memcpy(bot->top_card, top_card, card_size);
+  offset += card_size + PROTOCOL_INT_SIZE;
+
+  bot->symbols_per_card = symbols_per_card;
+  bot->players_count = players_count;
+  for (int i = 0; i < players_count; i++)
+  {
+    char name[MAX_PLAYER_NAME_LENGTH + 1] = {0};
+
+    offset += PROTOCOL_INT_SIZE;
+    memcpy(name, buffer + offset, MAX_PLAYER_NAME_LENGTH);
+    bot->peers[i] = strncmp(name, "lg", 2) == 0 ? atoi(name + 2) : -1;
+    if (bot->peers[i] >= config.connections_count)
+    {
+      bot->peers[i] = -1;
+    }
+    offset += MAX_PLAYER_NAME_LENGTH;
+    memcpy(bot->cards[i], buffer + offset, card_size);
+    offset += card_size;
+    memcpy(bot->counters[i], buffer + offset, LOADGEN_COUNTERS_COUNT * PROTOCOL_INT_SIZE);
+    offset += LOADGEN_COUNTERS_COUNT * PROTOCOL_INT_SIZE;
+  }
+
+  if (read_int(buffer, offset) != END_REQUEST)
+  {
+    return -1;
+  }
+  mark_state_received(bot);
+
+  return offset + PROTOCOL_INT_SIZE;
+}
+
+static void record_return_code(loadgen_worker_t *worker, bot_connection_t *bot, int return_code, uint64_t received_at)
+{
+  if (return_code >= 0 && return_code < RETURN_CODES_COUNT)
+  {
+    worker->return_codes[return_code]++;
+  }
+  if (bot->action_pending)
+  {
+    add_sample(&worker->round_trips, received_at - bot->action_sent_at);
+    bot->action_pending = 0;
+  }
+}
+
+static int is_bot_framed(bot_connection_t *bot)
+{
+  return bot->is_spectator || config.protocol_version == PROTOCOL_VERSION_FRAMED;
+}
+
+static void count_state_update(loadgen_worker_t *worker, bot_connection_t *bot, int bytes)
+{
+  if (bot->is_spectator)
+  {
+    worker->spectator_updates_count++;
+    worker->spectator_update_bytes += bytes;
+    return;
+  }
+  worker->state_updates_count++;
+  worker->state_update_bytes += bytes;
+}
+
+static void finish_bot_game(loadgen_worker_t *worker, bot_connection_t *bot)
+{
+  if (bot->is_spectator && !bot->has_state)
+  {
+    bot->reconnect_at = now_ns() + SPECTATOR_RETRY_NANOSECONDS;
+    worker->reconnecting_count++;
+    return;
+  }
+
+  if (is_bot_framed(bot))
+  {
+    char frame[FRAME_HEADER_SIZE];
+    send(bot->sockfd, frame, write_frame_header(frame, FINISH_GAME, 0), MSG_NOSIGNAL);
+  }
+  else
+  {
+    request_type_t finish_request = FINISH_GAME;
+    send(bot->sockfd, &finish_request, sizeof(finish_request), MSG_NOSIGNAL);
+  }
+  if (bot->is_spectator)
+  {
+    worker->spectated_games_count++;
+    return;
+  }
+  worker->games_count++;
+}
+
+static int read_le16(const char *buffer)
+{
+  const unsigned char *bytes = (const unsigned char *)buffer;
+  return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t read_le32(const unsigned char *bytes)
+{
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void write_le32(char *buffer, int32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    buffer[i] = ((uint32_t)value >> (8 * i)) & 0xff;
+  }
+}
+
+/*
+ * Decodes the payload of a framed state, whose length the frame header
+ * has already guaranteed to be present.
+ */
+static int parse_framed_game_state(loadgen_worker_t *worker, bot_connection_t *bot, const unsigned char *payload, int length,
+                                   uint64_t received_at)
+{
+  int top_card[MAX_SYMBOLS_PER_CARD];
+  int offset = 0;
+
+  if (length < 1)
+  {
+    return -1;
+  }
+  int symbols_per_card = payload[offset++];
+  if (symbols_per_card < 2 || symbols_per_card > MAX_SYMBOLS_PER_CARD || length < offset + symbols_per_card + 1)
+  {
+    return -1;
+  }
+  for (int i = 0; i < symbols_per_card; i++)
+  {
+    top_card[i] = payload[offset++];
+  }
+  int players_count = payload[offset++];
+  if (players_count > MAX_GAME_PLAYERS)
+  {
+    return -1;
+  }
+
+  record_fan_out(worker, bot, top_card, received_at);
+  memcpy(bot->top_card, top_card, sizeof(top_card));
+  bot->symbols_per_card = symbols_per_card;
+  bot->players_count = players_count;
+
+  for (int i = 0; i < players_count; i++)
+  {
+    char name[MAX_PLAYER_NAME_LENGTH + 1] = {0};
+
+    if (length < offset + 2 || length < offset + 2 + payload[offset + 1] + symbols_per_card + LOADGEN_COUNTERS_COUNT)
+    {
+      return -1;
+    }
+    int name_length = payload[offset + 1];
+    offset += 2;
+    memcpy(name, payload + offset, name_length < MAX_PLAYER_NAME_LENGTH ? name_length : MAX_PLAYER_NAME_LENGTH);
+    bot->peers[i] = strncmp(name, "lg", 2) == 0 ? atoi(name + 2) : -1;
+    if (bot->peers[i] >= config.connections_count)
+    {
+      bot->peers[i] = -1;
+    }
+    offset += name_length;
+    for (int j = 0; j < symbols_per_card; j++)
+    {
+      bot->cards[i][j] = payload[offset++];
+    }
+    for (int j = 0; j < LOADGEN_COUNTERS_COUNT; j++)
+    {
+      bot->counters[i][j] = payload[offset++];
+    }
+  }
+  if (length < offset + 4)
+  {
+    return -1;
+  }
+  bot->state_version = read_le32(payload + offset);
+  mark_state_received(bot);
+
+  return 0;
+}
+
+static void request_resync(loadgen_worker_t *worker, bot_connection_t *bot)
+{
+  char frame[FRAME_HEADER_SIZE];
+
+  bot->has_state = 0;
+  worker->resyncs_count++;
+  send(bot->sockfd, frame, write_frame_header(frame, SEND_GAME_STATE, 0), MSG_NOSIGNAL);
+}
+
+/*
+ * Applies a delta on top of the bot's state. A delta that does not start
+ * from the version the bot holds makes it ask for a full snapshot.
+ */
+static int parse_framed_game_delta(loadgen_worker_t *worker, bot_connection_t *bot, const unsigned char *payload, int length,
+                                   uint64_t received_at)
+{
+  int symbols_per_card = bot->symbols_per_card;
+  int offset = 9;
+
+  if (length < offset)
+  {
+    return -1;
+  }
+  if (!bot->has_state || read_le32(payload) != bot->state_version)
+  {
+    if (bot->has_state)
+    {
+      request_resync(worker, bot);
+    }
+    return 0;
+  }
+
+  if (payload[8])
+  {
+    int top_card[MAX_SYMBOLS_PER_CARD];
+
+    if (length < offset + symbols_per_card)
+    {
+      return -1;
+    }
+    for (int i = 0; i < symbols_per_card; i++)
+    {
+      top_card[i] = payload[offset++];
+    }
+    record_fan_out(worker, bot, top_card, received_at);
+    memcpy(bot->top_card, top_card, sizeof(top_card));
+  }
+
+  if (length < offset + 1)
+  {
+    return -1;
+  }
+  int changed_players_count = payload[offset++];
+  for (int i = 0; i < changed_players_count; i++)
+  {
+    if (length < offset + 3 || payload[offset] >= bot->players_count)
+    {
+      return -1;
+    }
+    int player_id = payload[offset];
+    int changed_fields = payload[offset + 1] | (payload[offset + 2] << 8);
+    offset += 3;
+
+    if (changed_fields & DELTA_PLAYER_CARD)
+    {
+      if (length < offset + symbols_per_card)
+      {
+        return -1;
+      }
+      for (int j = 0; j < symbols_per_card; j++)
+      {
+        bot->cards[player_id][j] = payload[offset++];
+      }
+    }
+    for (int j = 0; j < LOADGEN_COUNTERS_COUNT; j++)
+    {
+      if (changed_fields & DELTA_PLAYER_COUNTER(j))
+      {
+        if (length < offset + 1)
+        {
+          return -1;
+        }
+        bot->counters[player_id][j] = payload[offset++];
+      }
+    }
+  }
+  bot->state_version = read_le32(payload + 4);
+
+  return 0;
+}
+
+static int parse_server_frame(loadgen_worker_t *worker, bot_connection_t *bot, const char *buffer, int length, uint64_t received_at)
+{
+  if (length < FRAME_LENGTH_SIZE)
+  {
+    return 0;
+  }
+  int frame_length = read_le16(buffer);
+  if (frame_length < 1)
+  {
+    return -1;
+  }
+  if (length < FRAME_LENGTH_SIZE + frame_length)
+  {
+    return 0;
+  }
+
+  const unsigned char *payload = (const unsigned char *)buffer + FRAME_HEADER_SIZE;
+  int payload_length = frame_length - 1;
+
+  switch (buffer[FRAME_LENGTH_SIZE])
+  {
+  case SEND_GAME_METADATA:
+    if (payload_length < 2)
+    {
+      return -1;
+    }
+    bot->player_id = payload[1];
+    break;
+  case SEND_GAME_STATE:
+    if (parse_framed_game_state(worker, bot, payload, payload_length, received_at) < 0)
+    {
+      return -1;
+    }
+    count_state_update(worker, bot, FRAME_LENGTH_SIZE + frame_length);
+    break;
+  case SEND_GAME_DELTA:
+    if (parse_framed_game_delta(worker, bot, payload, payload_length, received_at) < 0)
+    {
+      return -1;
+    }
+    count_state_update(worker, bot, FRAME_LENGTH_SIZE + frame_length);
+    break;
+  case SEND_RETURN_CODE:
+    if (payload_length < 1)
+    {
+      return -1;
+    }
+    record_return_code(worker, bot, payload[0], received_at);
+    break;
+  case FINISH_GAME:
+    finish_bot_game(worker, bot);
+    break;
+  default:
+    break;
+  }
+
+  return FRAME_LENGTH_SIZE + frame_length;
+}
+
+/*
+ * Parses one server message from the start of the buffer. Returns the
+ * number of bytes consumed, 0 if the message is not complete yet and -1
+ * if the stream is malformed.
+ */
+static int parse_server_message(loadgen_worker_t *worker, bot_connection_t *bot, const char *buffer, int length, uint64_t received_at)
+{
+  if (!bot->has_communication_metadata)
+  {
+    if (length < 2)
+    {
+      return 0;
+    }
+    if (buffer[0] != sizeof(int))
+    {
+      return -1;
+    }
+    bot->has_communication_metadata = 1;
+    return 2;
+  }
+
+  if (is_bot_framed(bot))
+  {
+    return parse_server_frame(worker, bot, buffer, length, received_at);
+  }
+
+  if (length < PROTOCOL_INT_SIZE)
+  {
+    return 0;
+  }
+
+  switch (read_int(buffer, 0))
+  {
+  case SEND_GAME_METADATA:
+    if (length < 4 * PROTOCOL_INT_SIZE)
+    {
+      return 0;
+    }
+    bot->player_id = read_int(buffer, 2 * PROTOCOL_INT_SIZE);
+    return 4 * PROTOCOL_INT_SIZE;
+  case SEND_GAME_STATE:
+  {
+    int consumed = parse_game_state(worker, bot, buffer, length, received_at);
+    if (consumed > 0)
+    {
+      worker->state_updates_count++;
+      worker->state_update_bytes += consumed;
+    }
+    return consumed;
+  }
+  case SEND_RETURN_CODE:
+    if (length < 2 * PROTOCOL_INT_SIZE)
+    {
+      return 0;
+    }
+    record_return_code(worker, bot, read_int(buffer, PROTOCOL_INT_SIZE), received_at);
+    return 2 * PROTOCOL_INT_SIZE;
+  case FINISH_GAME:
+    finish_bot_game(worker, bot);
+    return PROTOCOL_INT_SIZE;
+  default:
+    return -1;
+  }
+}
+
+static void close_bot_connection(loadgen_worker_t *worker, bot_connection_t *bot)
+{
+  if (bot->is_closed)
+  {
+    return;
+  }
+
+  epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, bot->sockfd, NULL);
+  close(bot->sockfd);
+  bot->is_closed = 1;
+  worker->open_connections_count--;
+}
+
+static void open_bot_connection(loadgen_worker_t *worker, bot_connection_t *bot)
+{
+  struct epoll_event event;
+  int flag = 1;
+
+  if ((bot->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+  {
+    perror("socket failed");
+    exit(1);
+  }
+  setsockopt(bot->sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+  bot->connect_started_at = now_ns();
+  if (connect(bot->sockfd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0 && errno != EINPROGRESS)
+  {
+    perror("connect failed");
+    close(bot->sockfd);
+    bot->is_closed = 1;
+    worker->failed_connections_count++;
+    return;
+  }
+
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = bot;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, bot->sockfd, &event) < 0)
+  {
+    perror("epoll_ctl failed");
+    exit(1);
+  }
+  worker->open_connections_count++;
+}
+
+static void finish_bot_connect(loadgen_worker_t *worker, bot_connection_t *bot)
+{
+  char hello[PROTOCOL_HELLO_HEADER_SIZE + MAX_PLAYER_NAME_LENGTH];
+  int error = 0;
+  socklen_t error_length = sizeof(error);
+
+  if (getsockopt(bot->sockfd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0)
+  {
+    worker->failed_connections_count++;
+    close_bot_connection(worker, bot);
+    return;
+  }
+
+  bot->is_connected = 1;
+  add_sample(&worker->connect_latencies, now_ns() - bot->connect_started_at);
+
+  if (bot->is_spectator)
+  {
+    hello[0] = PROTOCOL_SPECTATE_MAGIC;
+    hello[1] = PROTOCOL_VERSION_FRAMED;
+    write_le32(hello + 2, bot->watched_room_id);
+    if (send(bot->sockfd, hello, PROTOCOL_SPECTATE_HELLO_SIZE, MSG_NOSIGNAL) != PROTOCOL_SPECTATE_HELLO_SIZE)
+    {
+      close_bot_connection(worker, bot);
+    }
+    return;
+  }
+
+  int name_length = snprintf(hello + PROTOCOL_HELLO_HEADER_SIZE, MAX_PLAYER_NAME_LENGTH, "lg%d", bot->index);
+  char *message = hello + PROTOCOL_HELLO_HEADER_SIZE;
+  int length = name_length;
+  if (config.protocol_version == PROTOCOL_VERSION_FRAMED)
+  {
+    hello[0] = PROTOCOL_HELLO_MAGIC;
+    hello[1] = PROTOCOL_VERSION_FRAMED;
+    hello[2] = name_length;
+    message = hello;
+    length += PROTOCOL_HELLO_HEADER_SIZE;
+  }
+  if (send(bot->sockfd, message, length, MSG_NOSIGNAL) != length)
+  {
+    close_bot_connection(worker, bot);
+  }
+}
+
+static void read_bot_connection(loadgen_worker_t *worker, bot_connection_t *bot)
+{
+  while (!bot->is_closed)
+  {
+    int received = recv(bot->sockfd, bot->input + bot->input_length, LOADGEN_INPUT_BUFFER_SIZE - bot->input_length, 0);
+
+    if (received > 0)
+    {
+      uint64_t received_at = now_ns();
+      int offset = 0;
+
+      bot->input_length += received;
+      while (offset < bot->input_length)
+      {
+        int consumed = parse_server_message(worker, bot, bot->input + offset, bot->input_length - offset, received_at);
+        if (consumed < 0)
+        {
+          fprintf(stderr, "Malformed message on connection %d\n", bot->index);
+          close_bot_connection(worker, bot);
+          return;
+        }
+        if (consumed == 0)
+        {
+          break;
+        }
+        offset += consumed;
+      }
+
+      memmove(bot->input, bot->input + offset, bot->input_length - offset);
+      bot->input_length -= offset;
+      continue;
+    }
+
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return;
+    }
+    close_bot_connection(worker, bot);
+  }
+}
+
+/*
+ * Plays the symbol the bot's card shares with the top card, with the hash
+ * of the last state it has seen.
+ */
+static void send_bot_action(loadgen_worker_t *worker, bot_connection_t *bot, uint64_t now)
+{
+  int *card = bot->cards[bot->player_id];
+  int symbol = card[0];
+
+  for (int i = 0; i < bot->symbols_per_card; i++)
+  {
+    for (int j = 0; j < bot->symbols_per_card; j++)
+    {
+      if (card[i] == bot->top_card[j])
+      {
+        symbol = card[i];
+        break;
+      }
+    }
+  }
+
+  int request[] = {MAKE_ACTION, CARD, symbol, calculate_bot_board_hash(bot), END_REQUEST};
+  char frame[FRAME_HEADER_SIZE + MAKE_VERSIONED_ACTION_FRAME_PAYLOAD_SIZE];
+  void *message = request;
+  int length = sizeof(request);
+
+  if (config.protocol_version == PROTOCOL_VERSION_FRAMED)
+  {
+    write_frame_header(frame, MAKE_ACTION, MAKE_VERSIONED_ACTION_FRAME_PAYLOAD_SIZE);
+    frame[FRAME_HEADER_SIZE] = CARD;
+    write_le32(frame + FRAME_HEADER_SIZE + 1, symbol);
+    write_le32(frame + FRAME_HEADER_SIZE + 5, request[3]);
+    write_le32(frame + FRAME_HEADER_SIZE + 9, bot->state_version);
+    message = frame;
+    length = sizeof(frame);
+  }
+
+  bot->action_pending = 1;
+  bot->action_sent_at = now;
+  __atomic_store_n(&bot->played_card, (card_key(card) << LOADGEN_TIMESTAMP_BITS) | ((now - started_at) & LOADGEN_TIMESTAMP_MASK),
+                   __ATOMIC_RELEASE);
+
+  if (send(bot->sockfd, message, length, MSG_NOSIGNAL) != length)
+  {
+    close_bot_connection(worker, bot);
+    return;
+  }
+  worker->actions_count++;
+}
+
+static void send_due_actions(loadgen_worker_t *worker, uint64_t now)
+{
+  uint64_t interval = config.actions_per_second > 0 ? (uint64_t)(1e9 / config.actions_per_second) : 0;
+
+  for (int i = 0; i < worker->connections_count; i++)
+  {
+    bot_connection_t *bot = &worker->connections[i];
+
+    if (bot->is_spectator || bot->is_closed || !bot->has_state || bot->action_pending || now < bot->next_action_at)
+    {
+      continue;
+    }
+
+    send_bot_action(worker, bot, now);
+    bot->next_action_at = bot->next_action_at + interval > now ? bot->next_action_at + interval : now;
+  }
+}
+
+/*
+ * Connects spectators that were told their room does not exist yet again.
+ */
+static void reconnect_spectators(loadgen_worker_t *worker, uint64_t now)
+{
+  for (int i = 0; i < worker->connections_count; i++)
+  {
+    bot_connection_t *bot = &worker->connections[i];
+
+    if (bot->reconnect_at == 0)
+    {
+      continue;
+    }
+    close_bot_connection(worker, bot);
+    if (now < bot->reconnect_at)
+    {
+      continue;
+    }
+
+    bot->reconnect_at = 0;
+    bot->is_closed = 0;
+    bot->is_connected = 0;
+    bot->has_communication_metadata = 0;
+    bot->input_length = 0;
+    worker->reconnecting_count--;
+    open_bot_connection(worker, bot);
+  }
+}
+
+static void *run_loadgen_worker(void *arg)
+{
+  loadgen_worker_t *worker = (loadgen_worker_t *)arg;
+  struct epoll_event events[MAX_EPOLL_EVENTS_PER_WAIT];
+  uint64_t deadline = started_at + (uint64_t)config.duration_seconds * 1000000000ULL;
+
+  for (int i = 0; i < worker->connections_count; i++)
+  {
+    open_bot_connection(worker, &worker->connections[i]);
+  }
+
+  while (worker->open_connections_count + worker->reconnecting_count > 0 && now_ns() < deadline)
+  {
+    int events_count = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS_PER_WAIT, 1);
+
+    for (int i = 0; i < events_count; i++)
+    {
+      bot_connection_t *bot = (bot_connection_t *)events[i].data.ptr;
+
+      if (!bot->is_connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      {
+        finish_bot_connect(worker, bot);
+      }
+      if (bot->is_connected && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+      {
+        read_bot_connection(worker, bot);
+      }
+    }
+
+    send_due_actions(worker, now_ns());
+    reconnect_spectators(worker, now_ns());
+  }
+
+  for (int i = 0; i < worker->connections_count; i++)
+  {
+    close_bot_connection(worker, &worker->connections[i]);
+  }
+
+  return NULL;
+}
+
+static void print_usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-t threads] [-r actions_per_second] [-d seconds] [-v protocol_version] "
+                  "[-w spectators] [-W watched_rooms]\n",
+          program);
+  exit(1);
+}
+
+static void parse_loadgen_config(int argc, char **argv)
+{
+  int option;
+
+  config.host = "127.0.0.1";
+  config.port = 8080;
+  config.connections_count = 3000;
+  config.threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+  config.actions_per_second = 5;
+  config.duration_seconds = 60;
+  config.protocol_version = PROTOCOL_VERSION_LEGACY;
+  config.spectators_count = 0;
+  config.watched_rooms_count = 1;
+
+  while ((option = getopt(argc, argv, "h:p:c:t:r:d:v:w:W:")) != -1)
+  {
+    switch (option)
+    {
+    case 'h':
+      config.host = optarg;
+      break;
+    case 'p':
+      config.port = atoi(optarg);
+      break;
+    case 'c':
+      config.connections_count = atoi(optarg);
+      break;
+    case 't':
+      config.threads_count = atoi(optarg);
+      break;
+    case 'r':
+      config.actions_per_second = atof(optarg);
+      break;
+    case 'd':
+      config.duration_seconds = atoi(optarg);
+      break;
+    case 'v':
+      config.protocol_version = atoi(optarg);
+      break;
+    case 'w':
+      config.spectators_count = atoi(optarg);
+      break;
+    case 'W':
+      config.watched_rooms_count = atoi(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+    }
+  }
+
+  if (config.threads_count < 1)
+  {
+    config.threads_count = 1;
+  }
+  if (config.protocol_version != PROTOCOL_VERSION_LEGACY && config.protocol_version != PROTOCOL_VERSION_FRAMED)
+  {
+    fprintf(stderr, "Unsupported protocol version %d\n", config.protocol_version);
+    exit(1);
+  }
+  if (config.spectators_count < 0 || config.watched_rooms_count < 1)
+  {
+    print_usage(argv[0]);
+  }
+  int bots_count = config.connections_count + config.spectators_count;
+  if (config.threads_count > bots_count)
+  {
+    config.threads_count = bots_count > 0 ? bots_count : 1;
+  }
+
+  server_address.sin_family = AF_INET;
+  server_address.sin_port = htons(config.port);
+  if (inet_pton(AF_INET, config.host, &server_address.sin_addr) != 1)
+  {
+    fprintf(stderr, "Invalid server address %s\n", config.host);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  loadgen_worker_t *workers;
+  loadgen_worker_t total;
+
+  parse_loadgen_config(argc, argv);
+
+  int bots_count = config.connections_count + config.spectators_count;
+  all_connections = (bot_connection_t *)calloc(bots_count > 0 ? bots_count : 1, sizeof(bot_connection_t));
+  workers = (loadgen_worker_t *)calloc(config.threads_count, sizeof(loadgen_worker_t));
+  if (all_connections == NULL || workers == NULL)
+  {
+    perror("loadgen calloc failed");
+    exit(1);
+  }
+
+  started_at = now_ns();
+
+  for (int i = 0, first_connection = 0; i < config.threads_count; i++)
+  {
+    loadgen_worker_t *worker = &workers[i];
+    worker->worker_id = i;
+    worker->connections = &all_connections[first_connection];
+    worker->connections_count = bots_count / config.threads_count + (i < bots_count % config.threads_count);
+    for (int j = 0; j < worker->connections_count; j++)
+    {
+      bot_connection_t *bot = &worker->connections[j];
+      bot->index = first_connection + j;
+      bot->is_spectator = bot->index >= config.connections_count;
+      bot->watched_room_id = (bot->index - config.connections_count) % config.watched_rooms_count;
+    }
+    first_connection += worker->connections_count;
+
+    if ((worker->epoll_fd = epoll_create1(0)) < 0)
+    {
+      perror("epoll_create1 failed");
+      exit(1);
+    }
+    if (pthread_create(&worker->thread, NULL, run_loadgen_worker, worker) != 0)
+    {
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < config.threads_count; i++)
+  {
+    loadgen_worker_t *worker = &workers[i];
+
+    pthread_join(worker->thread, NULL);
+    close(worker->epoll_fd);
+    merge_samples(&total.connect_latencies, &worker->connect_latencies);
+    merge_samples(&total.round_trips, &worker->round_trips);
+    merge_samples(&total.fan_out_delays, &worker->fan_out_delays);
+    merge_samples(&total.spectator_fan_out_delays, &worker->spectator_fan_out_delays);
+    total.actions_count += worker->actions_count;
+    total.games_count += worker->games_count;
+    total.spectated_games_count += worker->spectated_games_count;
+    total.spectator_updates_count += worker->spectator_updates_count;
+    total.spectator_update_bytes += worker->spectator_update_bytes;
+    total.failed_connections_count += worker->failed_connections_count;
+    total.resyncs_count += worker->resyncs_count;
+    total.state_updates_count += worker->state_updates_count;
+    total.state_update_bytes += worker->state_update_bytes;
+    for (int j = 0; j < RETURN_CODES_COUNT; j++)
+    {
+      total.return_codes[j] += worker->return_codes[j];
+    }
+  }
+
+  double seconds = (now_ns() - started_at) / 1e9;
+  samples_t first_game_delays = {NULL, 0, 0};
+  uint64_t last_first_game_at = started_at;
+
+  for (int i = 0; i < config.connections_count; i++)
+  {
+    bot_connection_t *bot = &all_connections[i];
+    if (bot->first_state_at != 0)
+    {
+      add_sample(&first_game_delays, bot->first_state_at - bot->connect_started_at);
+      if (bot->first_state_at > last_first_game_at)
+      {
+        last_first_game_at = bot->first_state_at;
+      }
+    }
+  }
+  double lobby_seconds = (last_first_game_at - started_at) / 1e9;
+
+  printf("%d connections on %d threads for %.3f s, %lld failed\n", config.connections_count, config.threads_count,
+         seconds, total.failed_connections_count);
+  printf("Actions: %lld (%.0f actions/s), finished games seen by players: %lld\n", total.actions_count,
+         total.actions_count / seconds, total.games_count);
+  printf("State updates: %lld, %.1f bytes per update, %lld resyncs\n", total.state_updates_count,
+         total.state_updates_count > 0 ? (double)total.state_update_bytes / total.state_updates_count : 0.0,
+         total.resyncs_count);
+  printf("Lobby: %zu players seated in games, %.0f players/s\n", first_game_delays.length,
+         lobby_seconds > 0 ? first_game_delays.length / lobby_seconds : 0.0);
+  if (config.spectators_count > 0)
+  {
+    printf("Spectators: %d watching %d rooms, %lld updates, %.1f bytes per update, finished games seen: %lld\n",
+           config.spectators_count, config.watched_rooms_count, total.spectator_updates_count,
+           total.spectator_updates_count > 0 ? (double)total.spectator_update_bytes / total.spectator_updates_count : 0.0,
+           total.spectated_games_count);
+  }
+  printf("Return codes:");
+  for (int i = 0; i < RETURN_CODES_COUNT; i++)
+  {
+    printf(" %d=%lld", i, total.return_codes[i]);
+  }
+  printf("\n");
+  print_samples("connect latency", &total.connect_latencies);
+  print_samples("time to first game", &first_game_delays);
+  print_samples("action round trip", &total.round_trips);
+  print_samples("broadcast fan-out", &total.fan_out_delays);
+  if (config.spectators_count > 0)
+  {
+    print_samples("spectator fan-out", &total.spectator_fan_out_delays);
+  }
+
+  free(total.connect_latencies.values);
+  free(first_game_delays.values);
+  free(total.round_trips.values);
+  free(total.fan_out_delays.values);
+  free(total.spectator_fan_out_delays.values);
+  free(workers);
+  free(all_connections);
+
+  return 0;
+}
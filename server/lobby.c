@@ -0,0 +1,75 @@
+#include "lobby.h"
+#include <stddef.h>
+
+void init_lobby(lobby_t *lobby)
+{
+  lobby->first = NULL;
+  lobby->last = NULL;
+  lobby->waiting_count = 0;
+  lobby->matched_count = 0;
+}
+
+void add_waiting_connection(lobby_t *lobby, connection_t *connection)
+{
+  connection->is_waiting = 1;
+  connection->lobby_prev = lobby->last;
+  connection->lobby_next = NULL;
+  if (lobby->last != NULL)
+  {
+    lobby->last->lobby_next = connection;
+  }
+  else
+  {
+    lobby->first = connection;
+  }
+  lobby->last = connection;
+  lobby->waiting_count++;
+}
+
+void remove_waiting_connection(lobby_t *lobby, connection_t *connection)
+{
+  if (!connection->is_waiting)
+  {
+    return;
+  }
+
+  if (connection->lobby_prev != NULL)
+  {
+    connection->lobby_prev->lobby_next = connection->lobby_next;
+  }
+  else
+  {
+    lobby->first = connection->lobby_next;
+  }
+  if (connection->lobby_next != NULL)
+  {
+    connection->lobby_next->lobby_prev = connection->lobby_prev;
+  }
+  else
+  {
+    lobby->last = connection->lobby_prev;
+  }
+  connection->is_waiting = 0;
+  lobby->waiting_count--;
+}
+
+/*
+ * Takes the count longest waiting connections when that many are waiting.
+ * Returns the number taken, either count or 0.
+ */
+int take_waiting_connections(lobby_t *lobby, connection_t **connections, int count)
+{
+  if (lobby->waiting_count < count)
+  {
+    return 0;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    connections[i] = lobby->first;
+    remove_waiting_connection(lobby, lobby->first);
+  }
+  lobby->matched_count += count;
+
+  return count;
+}
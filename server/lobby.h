@@ -0,0 +1,27 @@
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#include "connection.h"
+
+/*
+ * Players that completed their handshake wait here, oldest first, until
+ * enough of them are waiting to fill a room. Every worker has its own
+ * lobby, which only its thread touches, so the list takes no lock.
+ */
+typedef struct
+{
+  connection_t *first;
+  connection_t *last;
+  int waiting_count;
+  long long matched_count;
+} lobby_t;
+
+void init_lobby(lobby_t *lobby);
+
+void add_waiting_connection(lobby_t *lobby, connection_t *connection);
+
+void remove_waiting_connection(lobby_t *lobby, connection_t *connection);
+
+int take_waiting_connections(lobby_t *lobby, connection_t **connections, int count);
+
+#endif
@@ -0,0 +1,321 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_WRITER_IDLE_NANOSECONDS 1000000L
+#define LOG_SPEC_SIZE 32
+
+typedef struct log_ring
+{
+  log_record_t records[LOG_RING_SIZE];
+  uint64_t head;
+  uint64_t tail;
+  uint64_t drained_tail;
+  struct log_ring *next;
+} log_ring_t;
+
+static __thread log_ring_t *thread_ring;
+static log_ring_t *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer_thread;
+static int is_writer_running;
+static unsigned long long dropped_count;
+
+static uint64_t log_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Gives the calling thread its ring on first use. Rings live until the
+ * process exits, so the writer never races with a thread going away.
+ */
+static log_ring_t *get_thread_ring(void)
+{
+  if (thread_ring != NULL)
+  {
+    return thread_ring;
+  }
+
+  log_ring_t *ring = (log_ring_t *)calloc(1, sizeof(log_ring_t));
+  if (ring == NULL)
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&rings_mutex);
+  ring->next = rings;
+  __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_mutex);
+
+  thread_ring = ring;
+  return ring;
+}
+
+static log_record_t *reserve_log_record(int level)
+{
+  log_ring_t *ring = get_thread_ring();
+
+  if (ring == NULL || ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+  {
+    __atomic_fetch_add(&dropped_count, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  log_record_t *record = &ring->records[ring->tail % LOG_RING_SIZE];
+  record->timestamp_ns = log_now_ns();
+  record->level = level;
+  return record;
+}
+
+static void commit_log_record(void)
+{
+  __atomic_store_n(&thread_ring->tail, thread_ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+void log_message(int level, const char *format, int args_count, ...)
+{
+  log_record_t *record = reserve_log_record(level);
+  va_list args;
+
+  if (record == NULL)
+  {
+    return;
+  }
+
+  record->format = format;
+  record->args_count = args_count;
+  va_start(args, args_count);
+  for (int i = 0; i < args_count && i < LOG_MAX_ARGS; i++)
+  {
+    record->payload.args[i] = va_arg(args, int64_t);
+  }
+  va_end(args);
+
+  commit_log_record();
+}
+
+void log_text(int level, const char *format, ...)
+{
+  log_record_t *record = reserve_log_record(level);
+  va_list args;
+
+  if (record == NULL)
+  {
+    return;
+  }
+
+  record->format = NULL;
+  va_start(args, format);
+  vsnprintf(record->payload.text, LOG_TEXT_SIZE, format, args);
+  va_end(args);
+
+  commit_log_record();
+}
+
+/*
+ * Formats one conversion of a binary record. Integer conversions are
+ * widened to long long whatever length modifier the caller wrote.
+ */
+static void write_log_argument(FILE *file, const char *spec, int spec_length, char conversion, int64_t value)
+{
+  char widened[LOG_SPEC_SIZE + 3];
+  int length = 0;
+
+  for (int i = 0; i < spec_length - 1; i++)
+  {
+    if (strchr("hlzjtL", spec[i]) == NULL)
+    {
+      widened[length++] = spec[i];
+    }
+  }
+
+  switch (conversion)
+  {
+  case 'd':
+  case 'i':
+  case 'u':
+  case 'x':
+  case 'X':
+  case 'o':
+    widened[length++] = 'l';
+    widened[length++] = 'l';
+    widened[length++] = conversion;
+    widened[length] = '\0';
+    if (conversion == 'd' || conversion == 'i')
+    {
+      fprintf(file, widened, (long long)value);
+    }
+    else
+    {
+      fprintf(file, widened, (unsigned long long)value);
+    }
+    break;
+  case 'c':
+    widened[length++] = 'c';
+    widened[length] = '\0';
+    fprintf(file, widened, (int)value);
+    break;
+  case 's':
+    widened[length++] = 's';
+    widened[length] = '\0';
+    fprintf(file, widened, (const char *)(intptr_t)value);
+    break;
+  case 'p':
+    fprintf(file, "%p", (void *)(intptr_t)value);
+    break;
+  default:
+    fwrite(spec, 1, spec_length, file);
+    break;
+  }
+}
+
+static void write_log_record(log_record_t *record)
+{
+  FILE *file = record->level >= LOG_LEVEL_WARN ? stderr : stdout;
+  const char *format = record->format;
+  int arg = 0;
+
+  if (format == NULL)
+  {
+    fputs(record->payload.text, file);
+    return;
+  }
+
+  while (*format != '\0')
+  {
+    const char *percent = strchr(format, '%');
+    if (percent == NULL)
+    {
+      fputs(format, file);
+      return;
+    }
+    fwrite(format, 1, percent - format, file);
+
+    if (percent[1] == '%')
+    {
+      fputc('%', file);
+      format = percent + 2;
+      continue;
+    }
+
+    int spec_length = 1 + strspn(percent + 1, "-+ #0123456789.hlzjtL");
+    char conversion = percent[spec_length];
+    if (conversion == '\0' || spec_length >= LOG_SPEC_SIZE)
+    {
+      fputs(percent, file);
+      return;
+    }
+    spec_length++;
+
+    write_log_argument(file, percent, spec_length, conversion,
+                       arg < record->args_count ? record->payload.args[arg] : 0);
+    arg++;
+    format = percent + spec_length;
+  }
+}
+
+/*
+ * Writes every record committed when the drain starts, merged across the
+ * rings by timestamp, so lines of different threads come out in the order
+ * they were logged. Returns how many there were.
+ */
+static int drain_log_rings(void)
+{
+  log_ring_t *first_ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  int drained = 0;
+
+  for (log_ring_t *ring = first_ring; ring != NULL; ring = ring->next)
+  {
+    ring->drained_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  }
+
+  while (1)
+  {
+    log_ring_t *oldest = NULL;
+
+    for (log_ring_t *ring = first_ring; ring != NULL; ring = ring->next)
+    {
+      if (ring->head != ring->drained_tail &&
+          (oldest == NULL || ring->records[ring->head % LOG_RING_SIZE].timestamp_ns <
+                                 oldest->records[oldest->head % LOG_RING_SIZE].timestamp_ns))
+      {
+        oldest = ring;
+      }
+    }
+    if (oldest == NULL)
+    {
+      return drained;
+    }
+
+    write_log_record(&oldest->records[oldest->head % LOG_RING_SIZE]);
+    __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+    drained++;
+  }
+}
+
+static void *run_log_writer(void *arg)
+{
+  unsigned long long reported_drops = 0;
+  struct timespec idle = {0, LOG_WRITER_IDLE_NANOSECONDS};
+
+  (void)arg;
+
+  while (1)
+  {
+    int is_running = __atomic_load_n(&is_writer_running, __ATOMIC_ACQUIRE);
+    int drained = drain_log_rings();
+    unsigned long long drops = read_log_drops();
+
+    if (drops != reported_drops)
+    {
+      fprintf(stderr, "Dropped %llu log messages\n", drops - reported_drops);
+      reported_drops = drops;
+    }
+    if (drained > 0)
+    {
+      fflush(stdout);
+      fflush(stderr);
+    }
+    else if (!is_running)
+    {
+      break;
+    }
+    else
+    {
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+void start_logger(void)
+{
+  __atomic_store_n(&is_writer_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&writer_thread, NULL, run_log_writer, NULL) != 0)
+  {
+    perror("log writer pthread_create failed");
+    exit(1);
+  }
+}
+
+/*
+ * Stops the writer once everything logged so far has been written.
+ */
+void stop_logger(void)
+{
+  __atomic_store_n(&is_writer_running, 0, __ATOMIC_RELEASE);
+  pthread_join(writer_thread, NULL);
+}
+
+unsigned long long read_log_drops(void)
+{
+  return __atomic_load_n(&dropped_count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,102 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+/*
+ * Messages below LOG_LEVEL are compiled out. The build sets it from the
+ * LOG_LEVEL CMake option.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT_SIZE 112
+#define LOG_RING_SIZE 1024
+
+/*
+ * Every thread appends records to its own single-producer ring, which the
+ * writer thread drains. A record keeps the format and up to LOG_MAX_ARGS
+ * integer arguments, formatted only by the writer, or text the caller has
+ * already formatted. When a ring is full the record is counted and dropped
+ * instead of waiting.
+ */
+typedef struct
+{
+  uint64_t timestamp_ns;
+  const char *format;
+  uint8_t level;
+  uint8_t args_count;
+  union
+  {
+    int64_t args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_SIZE];
+  } payload;
+} log_record_t;
+
+void start_logger(void);
+
+void stop_logger(void);
+
+void log_message(int level, const char *format, int args_count, ...);
+
+void log_text(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+unsigned long long read_log_drops(void);
+
+/*
+ * LOG_DEBUG and friends take a printf format with integer arguments only,
+ * and %s arguments that are string literals, since formatting happens
+ * later on the writer thread. Anything else goes through LOG_TEXT, which
+ * formats on the calling thread.
+ */
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0, _)
+#define LOG_COUNT_(format, _1, _2, _3, _4, _5, _6, _7, _8, count, ...) count
+#define LOG_ARGS(...) LOG_ARGS_(LOG_COUNT(__VA_ARGS__), __VA_ARGS__)
+#define LOG_ARGS_(count, ...) LOG_ARGS__(count, __VA_ARGS__)
+#define LOG_ARGS__(count, ...) LOG_ARGS_##count(__VA_ARGS__)
+#define LOG_ARGS_0(format) format, 0
+#define LOG_ARGS_1(format, a) format, 1, (int64_t)(a)
+#define LOG_ARGS_2(format, a, b) format, 2, (int64_t)(a), (int64_t)(b)
+#define LOG_ARGS_3(format, a, b, c) format, 3, (int64_t)(a), (int64_t)(b), (int64_t)(c)
+#define LOG_ARGS_4(format, a, b, c, d) format, 4, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d)
+#define LOG_ARGS_5(format, a, b, c, d, e) \
+  format, 5, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d), (int64_t)(e)
+#define LOG_ARGS_6(format, a, b, c, d, e, f) \
+  format, 6, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d), (int64_t)(e), (int64_t)(f)
+#define LOG_ARGS_7(format, a, b, c, d, e, f, g) \
+  format, 7, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d), (int64_t)(e), (int64_t)(f), (int64_t)(g)
+#define LOG_ARGS_8(format, a, b, c, d, e, f, g, h)                                                         \
+  format, 8, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d), (int64_t)(e), (int64_t)(f), (int64_t)(g), \
+      (int64_t)(h)
+
+#define LOG_AT(level, ...)                        \
+  do                                              \
+  {                                               \
+    if ((level) >= LOG_LEVEL)                     \
+    {                                             \
+      log_message((level), LOG_ARGS(__VA_ARGS__)); \
+    }                                             \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#define LOG_TEXT(level, ...)           \
+  do                                   \
+  {                                    \
+    if ((level) >= LOG_LEVEL)          \
+    {                                  \
+      log_text((level), __VA_ARGS__); \
+    }                                  \
+  } while (0)
+
+#endif
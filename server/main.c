@@ -1,12 +1,82 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "server.h"
 
-int main(void)
+static void parse_server_config(int argc, char **argv, server_config_t *config)
+{
+  int option;
+
+  config->symbols_per_card = DEFAULT_SYMBOLS_PER_CARD;
+  config->tick_rate = 0;
+  config->players_per_room = DEFAULT_PLAYERS_PER_ROOM;
+  config->stats_path = NULL;
+  config->trace_path = NULL;
+  config->trace_sample_interval = DEFAULT_TRACE_SAMPLE_INTERVAL;
+  config->journal_path = NULL;
+  config->handoff_path = NULL;
+
+  while ((option = getopt(argc, argv, "s:t:p:S:T:R:J:H:")) != -1)
+  {
+    switch (option)
+    {
+    case 's':
+      config->symbols_per_card = atoi(optarg);
+      break;
+    case 't':
+      config->tick_rate = atoi(optarg);
+      break;
+    case 'p':
+      config->players_per_room = atoi(optarg);
+      break;
+    case 'S':
+      config->stats_path = optarg;
+      break;
+    case 'T':
+      config->trace_path = optarg;
+      break;
+    case 'R':
+      config->trace_sample_interval = atoi(optarg);
+      break;
+    case 'J':
+      config->journal_path = optarg;
+      break;
+    case 'H':
+      config->handoff_path = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-s symbols_per_card] [-t tick_rate] [-p players_per_room] [-S stats_path] [-T trace_path] "
+              "[-R trace_sample_interval] [-J journal_path] [-H handoff_path]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+
+  if (config->tick_rate < 0 || config->tick_rate > MAX_TICK_RATE)
+  {
+    fprintf(stderr, "Tick rate must be between 0 (off) and %d ticks per second\n", MAX_TICK_RATE);
+    exit(1);
+  }
+  if (config->players_per_room < 2 || config->players_per_room > MAX_PLAYERS)
+  {
+    fprintf(stderr, "Players per room must be between 2 and %d\n", MAX_PLAYERS);
+    exit(1);
+  }
+  if (config->trace_sample_interval < 1)
+  {
+    fprintf(stderr, "Trace sample interval must be at least 1\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
 {
   server_t server;
+  server_config_t config;
 
-  init_server(&server);
+  parse_server_config(argc, argv, &config);
+  init_server(&server, &config);
   run_server(&server);
   destroy_server(&server);
 
@@ -0,0 +1,60 @@
+#include "mpsc_queue.h"
+#include <stddef.h>
+
+void init_mpsc_queue(mpsc_queue_t *queue)
+{
+  queue->stub.next = NULL;
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(mpsc_queue_t *queue, queue_node_t *node)
+{
+  __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+  queue_node_t *previous = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the oldest node, or NULL when the queue is empty or a producer is
+ * halfway through a push. Callers that know more nodes are pending should
+ * simply retry.
+ */
+queue_node_t *mpsc_queue_pop(mpsc_queue_t *queue)
+{
+  queue_node_t *tail = queue->tail;
+  queue_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &queue->stub)
+  {
+    if (next == NULL)
+    {
+      return NULL;
+    }
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next != NULL)
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+  {
+    return NULL;
+  }
+
+  mpsc_queue_push(queue, &queue->stub);
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next != NULL)
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+typedef struct queue_node
+{
+  struct queue_node *next;
+} queue_node_t;
+
+/*
+ * Intrusive lock-free multi-producer single-consumer queue. Any thread may
+ * push, only the thread currently owning the queue may pop.
+ */
+typedef struct
+{
+  queue_node_t *head;
+  queue_node_t *tail;
+  queue_node_t stub;
+} mpsc_queue_t;
+
+void init_mpsc_queue(mpsc_queue_t *queue);
+
+void mpsc_queue_push(mpsc_queue_t *queue, queue_node_t *node);
+
+queue_node_t *mpsc_queue_pop(mpsc_queue_t *queue);
+
+#endif
@@ -0,0 +1,300 @@
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGE_BUFFER_INITIAL_CAPACITY 512
+
+static int read_int(const char *buffer, int index)
+{
+  int value;
+  memcpy(&value, buffer + index * PROTOCOL_INT_SIZE, sizeof(value));
+  return value;
+}
+
+/*
+ * Parses a single client request from the start of buffer. Returns the
+ * number of bytes consumed, 0 when the request is not complete yet and -1
+ * when the stream does not contain a valid request.
+ */
+int parse_request(const char *buffer, int length, request_t *request)
+{
+  if (length < PROTOCOL_INT_SIZE)
+  {
+    return 0;
+  }
+
+  request->request_type = (request_type_t)read_int(buffer, 0);
+
+  switch (request->request_type)
+  {
+  case SEND_GAME_STATE:
+  case FINISH_GAME:
+    return PROTOCOL_INT_SIZE;
+  case MAKE_ACTION:
+    if (length < MAKE_ACTION_REQUEST_SIZE)
+    {
+      return 0;
+    }
+    request->action.action_type = (actions_type_t)read_int(buffer, 1);
+    request->action.id = read_int(buffer, 2);
+    request->action.board_hash = read_int(buffer, 3);
+    request->action.state_version = 0;
+    if (read_int(buffer, 4) != END_REQUEST)
+    {
+      return -1;
+    }
+    return MAKE_ACTION_REQUEST_SIZE;
+  default:
+    return -1;
+  }
+}
+
+static int read_le16(const char *buffer)
+{
+  const unsigned char *bytes = (const unsigned char *)buffer;
+  return bytes[0] | (bytes[1] << 8);
+}
+
+static int32_t read_le32(const char *buffer)
+{
+  const unsigned char *bytes = (const unsigned char *)buffer;
+  return (int32_t)((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+}
+
+static void write_le16(char *buffer, int value)
+{
+  buffer[0] = value & 0xff;
+  buffer[1] = (value >> 8) & 0xff;
+}
+
+/*
+ * Parses the hello a framed client sends instead of its bare name. The
+ * name is returned as a view into buffer.
+ */
+int parse_hello(const char *buffer, int length, int *version, const char **name, int *name_length)
+{
+  if (length < PROTOCOL_HELLO_HEADER_SIZE)
+  {
+    return 0;
+  }
+  if (buffer[0] != PROTOCOL_HELLO_MAGIC)
+  {
+    return -1;
+  }
+
+  *version = (unsigned char)buffer[1];
+  *name_length = (unsigned char)buffer[2];
+  if (length < PROTOCOL_HELLO_HEADER_SIZE + *name_length)
+  {
+    return 0;
+  }
+  *name = buffer + PROTOCOL_HELLO_HEADER_SIZE;
+
+  return PROTOCOL_HELLO_HEADER_SIZE + *name_length;
+}
+
+/*
+ * Parses the hello of a spectator, which names the room to watch.
+ */
+int parse_spectate_hello(const char *buffer, int length, int *version, int *room_id)
+{
+  if (length < PROTOCOL_SPECTATE_HELLO_SIZE)
+  {
+    return 0;
+  }
+  if (buffer[0] != PROTOCOL_SPECTATE_MAGIC)
+  {
+    return -1;
+  }
+
+  *version = (unsigned char)buffer[1];
+  *room_id = read_le32(buffer + 2);
+
+  return PROTOCOL_SPECTATE_HELLO_SIZE;
+}
+
+/*
+ * Parses one frame straight out of the receive buffer. Returns the bytes
+ * consumed, 0 while the frame is incomplete and -1 for a malformed one.
+ * Frames of unknown types and trailing fields added by newer versions are
+ * skipped using the length header.
+ */
+int parse_frame(const char *buffer, int length, request_t *request)
+{
+  if (length < FRAME_LENGTH_SIZE)
+  {
+    return 0;
+  }
+
+  int frame_length = read_le16(buffer);
+  if (frame_length < 1)
+  {
+    return -1;
+  }
+  if (length < FRAME_LENGTH_SIZE + frame_length)
+  {
+    return 0;
+  }
+
+  const char *payload = buffer + FRAME_HEADER_SIZE;
+  int payload_length = frame_length - 1;
+
+  request->request_type = (request_type_t)(unsigned char)buffer[FRAME_LENGTH_SIZE];
+  switch (request->request_type)
+  {
+  case SEND_GAME_STATE:
+  case FINISH_GAME:
+    break;
+  case MAKE_ACTION:
+    if (payload_length < MAKE_ACTION_FRAME_PAYLOAD_SIZE)
+    {
+      return -1;
+    }
+    request->action.action_type = (actions_type_t)(unsigned char)payload[0];
+    request->action.id = read_le32(payload + 1);
+    request->action.board_hash = read_le32(payload + 5);
+    request->action.state_version = 0;
+    if (payload_length >= MAKE_VERSIONED_ACTION_FRAME_PAYLOAD_SIZE)
+    {
+      request->action.state_version = read_le32(payload + 9);
+    }
+    break;
+  default:
+    request->request_type = END_REQUEST;
+    break;
+  }
+
+  return FRAME_LENGTH_SIZE + frame_length;
+}
+
+/*
+ * Writes the header of a frame with the given payload size into buffer
+ * and returns the header size, for small frames built on the stack.
+ */
+int write_frame_header(char *buffer, request_type_t type, int payload_length)
+{
+  write_le16(buffer, payload_length + 1);
+  buffer[FRAME_LENGTH_SIZE] = type;
+  return FRAME_HEADER_SIZE;
+}
+
+void init_message_buffer(message_buffer_t *buffer)
+{
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+}
+
+void reset_message_buffer(message_buffer_t *buffer)
+{
+  buffer->length = 0;
+}
+
+/*
+ * Grows the buffer by length bytes and returns where they start, so
+ * encoders can write fields in place.
+ */
+char *reserve_message_bytes(message_buffer_t *buffer, int length)
+{
+  if (buffer->length + length > buffer->capacity)
+  {
+    int capacity = buffer->capacity > 0 ? buffer->capacity : MESSAGE_BUFFER_INITIAL_CAPACITY;
+    while (capacity < buffer->length + length)
+    {
+      capacity *= 2;
+    }
+
+    char *data = (char *)realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+      perror("message buffer realloc failed");
+      exit(1);
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+
+  char *bytes = buffer->data + buffer->length;
+  buffer->length += length;
+
+  return bytes;
+}
+
+void append_message_bytes(message_buffer_t *buffer, const void *data, int length)
+{
+  memcpy(reserve_message_bytes(buffer, length), data, length);
+}
+
+void append_message_int(message_buffer_t *buffer, int value)
+{
+  append_message_bytes(buffer, &value, sizeof(value));
+}
+
+void destroy_message_buffer(message_buffer_t *buffer)
+{
+  free(buffer->data);
+  init_message_buffer(buffer);
+}
+
+void append_message_u8(message_buffer_t *buffer, uint8_t value)
+{
+  append_message_bytes(buffer, &value, sizeof(value));
+}
+
+void append_message_le32(message_buffer_t *buffer, int32_t value)
+{
+  unsigned char bytes[] = {value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, ((uint32_t)value >> 24) & 0xff};
+  append_message_bytes(buffer, bytes, sizeof(bytes));
+}
+
+/*
+ * Starts a frame in buffer and returns its offset; end_message_frame fills
+ * in the length once the payload has been appended.
+ */
+int begin_message_frame(message_buffer_t *buffer, request_type_t type)
+{
+  char header[FRAME_HEADER_SIZE];
+  int frame_start = buffer->length;
+
+  write_frame_header(header, type, 0);
+  append_message_bytes(buffer, header, sizeof(header));
+
+  return frame_start;
+}
+
+void end_message_frame(message_buffer_t *buffer, int frame_start)
+{
+  write_le16(buffer->data + frame_start, buffer->length - frame_start - FRAME_LENGTH_SIZE);
+}
+
+shared_message_t *create_shared_message(const void *data, int length)
+{
+  shared_message_t *message = (shared_message_t *)malloc(sizeof(shared_message_t) + length);
+
+  if (message == NULL)
+  {
+    perror("shared message malloc failed");
+    exit(1);
+  }
+
+  message->references = 1;
+  message->length = length;
+  memcpy(message->data, data, length);
+
+  return message;
+}
+
+void retain_shared_message(shared_message_t *message)
+{
+  __atomic_add_fetch(&message->references, 1, __ATOMIC_RELAXED);
+}
+
+void release_shared_message(shared_message_t *message)
+{
+  if (__atomic_sub_fetch(&message->references, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    free(message);
+  }
+}
@@ -0,0 +1,122 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "game.h"
+
+#define PROTOCOL_INT_SIZE ((int)sizeof(int))
+#define MAKE_ACTION_REQUEST_SIZE (5 * PROTOCOL_INT_SIZE)
+
+/*
+ * Protocol versions. Legacy clients answer the communication metadata
+ * with their name and then exchange native-endian ints. Framed clients
+ * answer with a hello (a zero magic byte, the version, the name length
+ * and the name), after which every message in both directions is a frame:
+ * a little-endian uint16 length covering the type byte and the payload,
+ * the request_type_t byte and little-endian fixed-size fields. A
+ * MAKE_ACTION frame may end with the state version the action was made
+ * against, which then replaces the board hash.
+ */
+#define PROTOCOL_VERSION_LEGACY 1
+#define PROTOCOL_VERSION_FRAMED 2
+#define PROTOCOL_VERSION_BIT(version) (1 << (version))
+#define PROTOCOL_HELLO_MAGIC 0
+#define PROTOCOL_HELLO_HEADER_SIZE 3
+#define FRAME_LENGTH_SIZE 2
+#define FRAME_HEADER_SIZE (FRAME_LENGTH_SIZE + 1)
+#define MAKE_ACTION_FRAME_PAYLOAD_SIZE 9
+#define MAKE_VERSIONED_ACTION_FRAME_PAYLOAD_SIZE 13
+
+/*
+ * Spectators answer the communication metadata with a spectate hello (a
+ * magic byte of one, the framed version and the little-endian uint32 id of
+ * the room to watch) and then speak the framed protocol. Their metadata
+ * names SPECTATOR_PLAYER_ID as their seat, they get the state stream of
+ * the room and may ask for a snapshot, but cannot make actions.
+ */
+#define PROTOCOL_SPECTATE_MAGIC 1
+#define PROTOCOL_SPECTATE_HELLO_SIZE 6
+#define SPECTATOR_PLAYER_ID 0xff
+
+/*
+ * Framed players get a SEND_GAME_DELTA after each change instead of the
+ * whole state. A seat entry carries a little-endian uint16 mask of these
+ * bits followed by the new card and the changed counters, in the counter
+ * order of the state message.
+ */
+#define PLAYER_COUNTERS_COUNT 8
+#define DELTA_PLAYER_CARD 1
+#define DELTA_PLAYER_COUNTER(index) (1 << ((index) + 1))
+
+typedef enum request_type
+{
+  SEND_GAME_STATE,
+  END_REQUEST,
+  SEND_GAME_METADATA,
+  MAKE_ACTION,
+  FINISH_GAME,
+  SEND_RETURN_CODE,
+  SEND_GAME_DELTA
+} request_type_t;
+
+typedef struct
+{
+  request_type_t request_type;
+  action_t action;
+} request_t;
+
+typedef struct
+{
+  char *data;
+  int length;
+  int capacity;
+} message_buffer_t;
+
+/*
+ * An encoded message queued on many connections at once, e.g. one state
+ * update for every spectator of a room. It is never modified after it was
+ * created and is freed when the last connection releases it.
+ */
+typedef struct
+{
+  int references;
+  int length;
+  char data[];
+} shared_message_t;
+
+int parse_request(const char *buffer, int length, request_t *request);
+
+int parse_hello(const char *buffer, int length, int *version, const char **name, int *name_length);
+
+int parse_spectate_hello(const char *buffer, int length, int *version, int *room_id);
+
+int parse_frame(const char *buffer, int length, request_t *request);
+
+int write_frame_header(char *buffer, request_type_t type, int payload_length);
+
+void init_message_buffer(message_buffer_t *buffer);
+
+void reset_message_buffer(message_buffer_t *buffer);
+
+char *reserve_message_bytes(message_buffer_t *buffer, int length);
+
+void append_message_bytes(message_buffer_t *buffer, const void *data, int length);
+
+void append_message_int(message_buffer_t *buffer, int value);
+
+void append_message_u8(message_buffer_t *buffer, uint8_t value);
+
+void append_message_le32(message_buffer_t *buffer, int32_t value);
+
+int begin_message_frame(message_buffer_t *buffer, request_type_t type);
+
+void end_message_frame(message_buffer_t *buffer, int frame_start);
+
+void destroy_message_buffer(message_buffer_t *buffer);
+
+shared_message_t *create_shared_message(const void *data, int length);
+
+void retain_shared_message(shared_message_t *message);
+
+void release_shared_message(shared_message_t *message);
+
+#endif
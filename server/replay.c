@@ -0,0 +1,434 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "game.h"
+#include "journal.h"
+
+#define NO_REPLAYED_ROOM -1
+
+typedef struct
+{
+  int threads_count;
+  long long printed_room_id;
+} replay_config_t;
+
+/*
+ * The records of one journaled game. The card order of the started record
+ * points into the journal buffer, which lives until the tool exits.
+ */
+typedef struct
+{
+  const char *path;
+  journal_record_t started;
+  journal_record_t finished;
+  int has_finished_record;
+  journal_record_t *actions;
+  int actions_count;
+  int actions_capacity;
+} replayed_room_t;
+
+typedef struct
+{
+  replayed_room_t **rooms;
+  int rooms_count;
+  int next_room;
+} replay_t;
+
+typedef struct
+{
+  long long rooms_count;
+  long long actions_count;
+  long long skipped_actions_count;
+  long long invalid_rooms_count;
+  long long mismatched_deals_count;
+  long long mismatched_actions_count;
+  long long mismatched_finals_count;
+  long long unfinished_rooms_count;
+} replay_totals_t;
+
+typedef struct
+{
+  replay_t *replay;
+  pthread_t thread;
+  replay_totals_t totals;
+} replay_shard_t;
+
+static void print_usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-t threads] [-r room_id] journal...\n", program);
+  exit(1);
+}
+
+static void parse_replay_config(int argc, char **argv, replay_config_t *config)
+{
+  int option;
+
+  config->threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+  config->printed_room_id = NO_REPLAYED_ROOM;
+
+  while ((option = getopt(argc, argv, "t:r:")) != -1)
+  {
+    switch (option)
+    {
+    case 't':
+      config->threads_count = atoi(optarg);
+      break;
+    case 'r':
+      config->printed_room_id = atoll(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc)
+  {
+    print_usage(argv[0]);
+  }
+  if (config->threads_count < 1)
+  {
+    config->threads_count = 1;
+  }
+}
+
+static uint8_t *read_journal_file(const char *path, long *length)
+{
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (*length = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0)
+  {
+    perror(path);
+    exit(1);
+  }
+
+  uint8_t *data = (uint8_t *)malloc(*length > 0 ? *length : 1);
+  if (data == NULL)
+  {
+    perror("journal malloc failed");
+    exit(1);
+  }
+  if (fread(data, 1, *length, file) != (size_t)*length)
+  {
+    perror(path);
+    exit(1);
+  }
+  fclose(file);
+
+  return data;
+}
+
+static void add_replayed_room(replay_t *replay, replayed_room_t *room)
+{
+  replay->rooms = (replayed_room_t **)realloc(replay->rooms, (replay->rooms_count + 1) * sizeof(replayed_room_t *));
+  if (replay->rooms == NULL)
+  {
+    perror("rooms realloc failed");
+    exit(1);
+  }
+  replay->rooms[replay->rooms_count++] = room;
+}
+
+static void add_replayed_action(replayed_room_t *room, const journal_record_t *record)
+{
+  if (room->actions_count == room->actions_capacity)
+  {
+    room->actions_capacity = room->actions_capacity > 0 ? room->actions_capacity * 2 : 64;
+    room->actions = (journal_record_t *)realloc(room->actions, room->actions_capacity * sizeof(journal_record_t));
+    if (room->actions == NULL)
+    {
+      perror("actions realloc failed");
+      exit(1);
+    }
+  }
+  room->actions[room->actions_count++] = *record;
+}
+
+/*
+ * Splits the interleaved records of a journal into its games. Room ids
+ * are handed out in order and carry over handoffs together with the games
+ * still running, so they index the games of the file directly and a game
+ * taken over is checked as a whole. A truncated last record, left by a server that was
+ * killed, is ignored.
+ */
+static void load_journal(replay_t *replay, const char *path)
+{
+  long length;
+  uint8_t *data = read_journal_file(path, &length);
+  replayed_room_t **file_rooms = NULL;
+  long file_rooms_count = 0;
+  long offset = JOURNAL_HEADER_SIZE;
+
+  if (length < JOURNAL_HEADER_SIZE || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0 ||
+      data[JOURNAL_MAGIC_SIZE] != JOURNAL_VERSION)
+  {
+    fprintf(stderr, "%s is not a version %d journal\n", path, JOURNAL_VERSION);
+    exit(1);
+  }
+
+  while (offset < length)
+  {
+    journal_record_t record;
+    int consumed = decode_journal_record(data + offset, length - offset, &record);
+
+    if (consumed < 0)
+    {
+      fprintf(stderr, "%s has an invalid record at offset %ld\n", path, offset);
+      exit(1);
+    }
+    if (consumed == 0)
+    {
+      fprintf(stderr, "%s ends with a truncated record\n", path);
+      break;
+    }
+    offset += consumed;
+
+    if (record.record_type == ROOM_STARTED)
+    {
+      if (record.room_id >= file_rooms_count)
+      {
+        long count = record.room_id + 1 > 2 * file_rooms_count ? record.room_id + 1 : 2 * file_rooms_count;
+        file_rooms = (replayed_room_t **)realloc(file_rooms, count * sizeof(replayed_room_t *));
+        if (file_rooms == NULL)
+        {
+          perror("rooms realloc failed");
+          exit(1);
+        }
+        memset(file_rooms + file_rooms_count, 0, (count - file_rooms_count) * sizeof(replayed_room_t *));
+        file_rooms_count = count;
+      }
+
+      replayed_room_t *room = (replayed_room_t *)calloc(1, sizeof(replayed_room_t));
+      if (room == NULL)
+      {
+        perror("room calloc failed");
+        exit(1);
+      }
+      room->path = path;
+      room->started = record;
+      file_rooms[record.room_id] = room;
+      add_replayed_room(replay, room);
+      continue;
+    }
+
+    replayed_room_t *room = record.room_id < file_rooms_count ? file_rooms[record.room_id] : NULL;
+    if (room == NULL)
+    {
+      fprintf(stderr, "%s has a record of room %u before its start\n", path, record.room_id);
+      exit(1);
+    }
+    if (record.record_type == ACTION_MADE)
+    {
+      add_replayed_action(room, &record);
+    }
+    else
+    {
+      room->finished = record;
+      room->has_finished_record = 1;
+    }
+  }
+
+  free(file_rooms);
+}
+
+static void print_replayed_state(FILE *output, game_t *game, int index, uint64_t started_at,
+                                 const journal_record_t *record, return_code_t return_code)
+{
+  fprintf(output, "%6d +%.3f ms player %d action %d id %d -> %d, hash %d, top card %d, cards", index,
+          (int64_t)(record->timestamp_ns - started_at) / 1e6, record->payload.action.player_id,
+          record->payload.action.action_type, record->payload.action.id, return_code, get_board_hash(game),
+          game->current_top_card_index);
+  for (int i = 0; i < game->players_count; i++)
+  {
+    fprintf(output, " %d", game->player_states[i].cards_in_hand_count);
+  }
+  fprintf(output, "%s\n", game->has_finished ? ", finished" : "");
+}
+
+/*
+ * Deals the journaled game again from its seed and feeds every action
+ * through act_player, checking the deal, each return code and the final
+ * board hash against the journal. Actions the server rejected as stale
+ * never reached the game and are skipped, which only older journals still
+ * contain. With an output, the state after every action is printed.
+ */
+static void replay_room(const replayed_room_t *room, replay_totals_t *totals, FILE *output)
+{
+  const journal_record_t *started = &room->started;
+  const deck_t *deck = get_deck(started->payload.started.symbols_per_card);
+  game_t game;
+  deal_t deal;
+  int players_count = started->payload.started.players_count;
+
+  totals->rooms_count++;
+  if (deck == NULL || players_count < 1 || players_count > MAX_GAME_PLAYERS)
+  {
+    totals->invalid_rooms_count++;
+    return;
+  }
+
+  deal_cards(&deal, deck, started->payload.started.seed);
+  init_game(&game, deck, &deal, players_count);
+  if (started->payload.started.cards_count != deck->cards_count ||
+      memcmp(deal.card_order, started->payload.started.card_order, deck->cards_count) != 0)
+  {
+    totals->mismatched_deals_count++;
+  }
+
+  for (int i = 0; i < room->actions_count; i++)
+  {
+    const journal_record_t *record = &room->actions[i];
+    return_code_t return_code = record->payload.action.return_code;
+
+    if (return_code == INCORRECT_BOARD_HASH)
+    {
+      totals->skipped_actions_count++;
+      continue;
+    }
+    if (record->payload.action.player_id >= players_count || record->payload.action.action_type > REROLL)
+    {
+      totals->invalid_rooms_count++;
+      return;
+    }
+
+    action_t action = {record->payload.action.action_type, record->payload.action.id, 0, 0};
+    return_code_t replayed_return_code = act_player(&game, &action, record->payload.action.player_id);
+    totals->actions_count++;
+    if (replayed_return_code != return_code)
+    {
+      totals->mismatched_actions_count++;
+    }
+    if (output != NULL)
+    {
+      print_replayed_state(output, &game, i, started->timestamp_ns, record, replayed_return_code);
+    }
+  }
+
+  if (!room->has_finished_record)
+  {
+    totals->unfinished_rooms_count++;
+  }
+  else if (room->finished.payload.finished.board_hash != get_board_hash(&game) ||
+           room->finished.payload.finished.has_finished != game.has_finished)
+  {
+    totals->mismatched_finals_count++;
+  }
+}
+
+static void *run_replay_shard(void *arg)
+{
+  replay_shard_t *shard = (replay_shard_t *)arg;
+  replay_t *replay = shard->replay;
+  replay_totals_t totals;
+
+  memset(&totals, 0, sizeof(totals));
+  while (1)
+  {
+    int index = __atomic_fetch_add(&replay->next_room, 1, __ATOMIC_RELAXED);
+    if (index >= replay->rooms_count)
+    {
+      break;
+    }
+    replay_room(replay->rooms[index], &totals, NULL);
+  }
+  shard->totals = totals;
+
+  return NULL;
+}
+
+static void add_replay_totals(replay_totals_t *totals, const replay_totals_t *shard_totals)
+{
+  totals->rooms_count += shard_totals->rooms_count;
+  totals->actions_count += shard_totals->actions_count;
+  totals->skipped_actions_count += shard_totals->skipped_actions_count;
+  totals->invalid_rooms_count += shard_totals->invalid_rooms_count;
+  totals->mismatched_deals_count += shard_totals->mismatched_deals_count;
+  totals->mismatched_actions_count += shard_totals->mismatched_actions_count;
+  totals->mismatched_finals_count += shard_totals->mismatched_finals_count;
+  totals->unfinished_rooms_count += shard_totals->unfinished_rooms_count;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  replay_config_t config;
+  replay_t replay;
+  replay_totals_t totals;
+  struct timespec start, end;
+
+  parse_replay_config(argc, argv, &config);
+  memset(&replay, 0, sizeof(replay));
+  memset(&totals, 0, sizeof(totals));
+
+  for (int i = optind; i < argc; i++)
+  {
+    load_journal(&replay, argv[i]);
+  }
+
+  if (config.printed_room_id != NO_REPLAYED_ROOM)
+  {
+    for (int i = 0; i < replay.rooms_count; i++)
+    {
+      replayed_room_t *room = replay.rooms[i];
+      replay_totals_t room_totals;
+
+      if (room->started.room_id != config.printed_room_id)
+      {
+        continue;
+      }
+      memset(&room_totals, 0, sizeof(room_totals));
+      printf("Room %u of %s, seed %llu, %d players, %d symbols per card\n", room->started.room_id, room->path,
+             (unsigned long long)room->started.payload.started.seed, room->started.payload.started.players_count,
+             room->started.payload.started.symbols_per_card);
+      replay_room(room, &room_totals, stdout);
+    }
+  }
+
+  replay_shard_t *shards = (replay_shard_t *)calloc(config.threads_count, sizeof(replay_shard_t));
+  if (shards == NULL)
+  {
+    perror("shards calloc failed");
+    exit(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < config.threads_count; i++)
+  {
+    shards[i].replay = &replay;
+    if (pthread_create(&shards[i].thread, NULL, run_replay_shard, &shards[i]) != 0)
+    {
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < config.threads_count; i++)
+  {
+    pthread_join(shards[i].thread, NULL);
+    add_replay_totals(&totals, &shards[i].totals);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = elapsed_seconds(&start, &end);
+
+  printf("Replayed %lld games and %lld actions from %d journals on %d threads in %.3f s (%.0f actions/s)\n",
+         totals.rooms_count, totals.actions_count, argc - optind, config.threads_count, seconds,
+         seconds > 0 ? totals.actions_count / seconds : 0.0);
+  printf("Skipped stale actions: %lld, unfinished games: %lld, invalid games: %lld\n", totals.skipped_actions_count,
+         totals.unfinished_rooms_count, totals.invalid_rooms_count);
+  printf("Mismatched deals: %lld, return codes: %lld, final states: %lld\n", totals.mismatched_deals_count,
+         totals.mismatched_actions_count, totals.mismatched_finals_count);
+
+  free(shards);
+  destroy_decks();
+
+  int has_mismatches = totals.mismatched_deals_count > 0 || totals.mismatched_actions_count > 0 ||
+                       totals.mismatched_finals_count > 0 || totals.invalid_rooms_count > 0;
+  return has_mismatches ? 1 : 0;
+}
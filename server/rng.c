@@ -0,0 +1,59 @@
+#include "rng.h"
+
+static uint64_t rotate_left(uint64_t value, int shift)
+{
+  return (value << shift) | (value >> (64 - shift));
+}
+
+uint64_t splitmix64(uint64_t *state)
+{
+  uint64_t value = (*state += 0x9E3779B97F4A7C15ULL);
+  value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+  return value ^ (value >> 31);
+}
+
+void seed_rng(rng_t *rng, uint64_t seed)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    rng->state[i] = splitmix64(&seed);
+  }
+}
+
+uint64_t next_random(rng_t *rng)
+{
+  uint64_t *state = rng->state;
+  uint64_t result = rotate_left(state[1] * 5, 7) * 9;
+  uint64_t shifted = state[1] << 17;
+
+  state[2] ^= state[0];
+  state[3] ^= state[1];
+  state[1] ^= state[2];
+  state[0] ^= state[3];
+  state[2] ^= shifted;
+  state[3] = rotate_left(state[3], 45);
+
+  return result;
+}
+
+/*
+ * Unbiased integer in [0, bound) using Lemire's multiply-and-reject method.
+ */
+uint32_t random_below(rng_t *rng, uint32_t bound)
+{
+  uint64_t product = (uint64_t)(uint32_t)(next_random(rng) >> 32) * bound;
+  uint32_t low = (uint32_t)product;
+
+  if (low < bound)
+  {
+    uint32_t threshold = -bound % bound;
+    while (low < threshold)
+    {
+      product = (uint64_t)(uint32_t)(next_random(rng) >> 32) * bound;
+      low = (uint32_t)product;
+    }
+  }
+
+  return (uint32_t)(product >> 32);
+}
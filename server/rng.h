@@ -0,0 +1,23 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * xoshiro256** generator. Each room seeds its own instance, so rooms never
+ * share generator state and a seed fully determines a deal.
+ */
+typedef struct
+{
+  uint64_t state[4];
+} rng_t;
+
+uint64_t splitmix64(uint64_t *state);
+
+void seed_rng(rng_t *rng, uint64_t seed);
+
+uint64_t next_random(rng_t *rng);
+
+uint32_t random_below(rng_t *rng, uint32_t bound);
+
+#endif
@@ -0,0 +1,685 @@
+#include "room.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+void init_room_manager(room_manager_t *manager, const room_config_t *config)
+{
+  manager->config = *config;
+  manager->rooms = NULL;
+  manager->rooms_count = 0;
+  manager->next_room_id = 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  manager->seed_base = ((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) ^ ((uint64_t)getpid() << 32);
+
+  if (pthread_mutex_init(&manager->mutex, NULL) != 0)
+  {
+    perror("room manager mutex init failed");
+    exit(1);
+  }
+}
+
+room_t *create_room(room_manager_t *manager)
+{
+  room_t *room = (room_t *)malloc(sizeof(room_t));
+
+  if (room == NULL)
+  {
+    perror("room malloc failed");
+    exit(1);
+  }
+
+  room->deck = manager->config.deck;
+  room->worker = NULL;
+  room->tick_rate = manager->config.tick_rate;
+  room->players_count = manager->config.players_per_room;
+  room->ticker.source_type = ROOM_TICKER_SOURCE;
+  room->ticker.timer_fd = -1;
+  room->ticker.epoll_fd = -1;
+  room->ticker.is_stopped = 0;
+  room->ticker.room = room;
+  room->tick_actions_count = 0;
+  room->num_players = 0;
+  room->ready_players = 0;
+  room->has_started = 0;
+  room->references = 1;
+  room->pending_events = 0;
+  init_mpsc_queue(&room->events);
+  room->game.players_count = 0;
+  room->actions_count = 0;
+  memset(&room->stats, 0, sizeof(room->stats));
+  if (pthread_mutex_init(&room->journal.mutex, NULL) != 0)
+  {
+    perror("room journal mutex init failed");
+    exit(1);
+  }
+  room->journal.chunk = NULL;
+  room->journal.is_open = 0;
+  init_message_buffer(&room->state_message);
+  init_message_buffer(&room->state_frame);
+  init_message_buffer(&room->delta_frame);
+  room->state_version = 0;
+  room->broadcast_version = 0;
+  room->state_frame_version = 0;
+  room->protocol_versions = 0;
+  room->spectators = NULL;
+  room->spectators_count = 0;
+  room->spectators_capacity = 0;
+
+  for (int i = 0; i < MAX_PLAYERS; i++)
+  {
+    room->player_list[i].player_id = i;
+    room->player_list[i].connection = NULL;
+    memset(room->player_list[i].name, 0, MAX_PLAYER_NAME_LENGTH);
+  }
+
+  pthread_mutex_lock(&manager->mutex);
+  room->room_id = manager->next_room_id++;
+  uint64_t seed_state = manager->seed_base + room->room_id;
+  room->seed = splitmix64(&seed_state);
+  room->prev = NULL;
+  room->next = manager->rooms;
+  if (manager->rooms != NULL)
+  {
+    manager->rooms->prev = room;
+  }
+  manager->rooms = room;
+  manager->rooms_count++;
+  pthread_mutex_unlock(&manager->mutex);
+
+  return room;
+}
+
+/*
+ * Reserves the next seat of a room for a new connection. Only the thread
+ * forming the room adds players, the connection keeps a reference on the
+ * room until it has left.
+ */
+int add_room_player(room_t *room)
+{
+  int player_id = room->num_players;
+
+  __atomic_add_fetch(&room->references, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&room->num_players, player_id + 1, __ATOMIC_RELEASE);
+
+  return player_id;
+}
+
+void retain_room(room_t *room)
+{
+  __atomic_add_fetch(&room->references, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Looks a room up by id and retains it for the caller. A room whose last
+ * reference is already gone is about to be freed and is not returned.
+ */
+room_t *find_room(room_manager_t *manager, int room_id)
+{
+  room_t *room;
+
+  pthread_mutex_lock(&manager->mutex);
+  for (room = manager->rooms; room != NULL; room = room->next)
+  {
+    if (room->room_id != room_id)
+    {
+      continue;
+    }
+
+    int references = __atomic_load_n(&room->references, __ATOMIC_RELAXED);
+    do
+    {
+      if (references == 0)
+      {
+        room = NULL;
+        break;
+      }
+    } while (!__atomic_compare_exchange_n(&room->references, &references, references + 1, 0, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    break;
+  }
+  pthread_mutex_unlock(&manager->mutex);
+
+  return room;
+}
+
+/*
+ * Spectators are only added and removed by the room's actor. Their count
+ * is also read by the stats reporter.
+ */
+void add_room_spectator(room_t *room, struct connection *connection)
+{
+  if (room->spectators_count == room->spectators_capacity)
+  {
+    room->spectators_capacity = room->spectators_capacity > 0 ? room->spectators_capacity * 2 : 16;
+    room->spectators = (struct connection **)realloc(room->spectators,
+                                                     room->spectators_capacity * sizeof(struct connection *));
+    if (room->spectators == NULL)
+    {
+      perror("room spectators realloc failed");
+      exit(1);
+    }
+  }
+
+  room->spectators[room->spectators_count] = connection;
+  __atomic_store_n(&room->spectators_count, room->spectators_count + 1, __ATOMIC_RELAXED);
+}
+
+void remove_room_spectator(room_t *room, struct connection *connection)
+{
+  for (int i = 0; i < room->spectators_count; i++)
+  {
+    if (room->spectators[i] == connection)
+    {
+      room->spectators[i] = room->spectators[room->spectators_count - 1];
+      __atomic_store_n(&room->spectators_count, room->spectators_count - 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+int is_room_ready(room_t *room)
+{
+  return room->ready_players == room->players_count;
+}
+
+room_event_t *create_room_event(room_event_type_t event_type, int player_id)
+{
+  room_event_t *event = (room_event_t *)malloc(sizeof(room_event_t));
+
+  if (event == NULL)
+  {
+    perror("room event malloc failed");
+    exit(1);
+  }
+
+  event->event_type = event_type;
+  event->player_id = player_id;
+  event->connection = NULL;
+  event->trace_id = 0;
+
+  return event;
+}
+
+/*
+ * Queues an event for the room. Returns 1 when the caller has become the
+ * room's actor and must drain the queue with pop_room_event and
+ * finish_room_events.
+ */
+int push_room_event(room_t *room, room_event_t *event)
+{
+  mpsc_queue_push(&room->events, &event->node);
+
+  return __atomic_fetch_add(&room->pending_events, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+room_event_t *pop_room_event(room_t *room)
+{
+  queue_node_t *node;
+
+  while ((node = mpsc_queue_pop(&room->events)) == NULL)
+  {
+    sched_yield();
+  }
+
+  return (room_event_t *)node;
+}
+
+/*
+ * Acknowledges processed events. Returns 1 while more events are pending,
+ * in which case the caller stays the actor and keeps draining.
+ */
+int finish_room_events(room_t *room, int processed)
+{
+  return __atomic_sub_fetch(&room->pending_events, processed, __ATOMIC_ACQ_REL) != 0;
+}
+
+static void encode_legacy_state(room_t *room)
+{
+  message_buffer_t *message = &room->state_message;
+  game_t *game = &room->game;
+  const deck_t *deck = game->deck;
+  int card_size = deck->symbols_per_card * sizeof(int);
+
+  reset_message_buffer(message);
+  append_message_int(message, SEND_GAME_STATE);
+
+  append_message_int(message, deck->symbols_per_card);
+  append_message_bytes(message, get_card_symbols(deck, game->current_top_card_index), card_size);
+
+  append_message_int(message, game->players_count);
+  for (int i = 0; i < game->players_count; i++)
+  {
+    player_state_t *player = &game->player_states[i];
+    append_message_int(message, player->player_id);
+    append_message_bytes(message, room->player_list[i].name, MAX_PLAYER_NAME_LENGTH);
+    append_message_bytes(message, get_card_symbols(deck, player->current_card_index), card_size);
+    append_message_int(message, player->cards_in_hand_count);
+    append_message_int(message, player->swaps_left);
+    append_message_int(message, player->swaps_cooldown);
+    append_message_int(message, player->freezes_left);
+    append_message_int(message, player->freezes_cooldown);
+    append_message_int(message, player->rerolls_left);
+    append_message_int(message, player->rerolls_cooldown);
+    append_message_int(message, player->is_frozen_count);
+  }
+
+  append_message_int(message, END_REQUEST);
+}
+
+static void append_card_symbols(message_buffer_t *message, const deck_t *deck, int card_index)
+{
+  const int *symbols = get_card_symbols(deck, card_index);
+  char *bytes = reserve_message_bytes(message, deck->symbols_per_card);
+
+  for (int i = 0; i < deck->symbols_per_card; i++)
+  {
+    bytes[i] = symbols[i];
+  }
+}
+
+static void read_player_counters(const player_state_t *player, uint8_t *counters)
+{
+  counters[0] = player->cards_in_hand_count;
+  counters[1] = player->swaps_left;
+  counters[2] = player->swaps_cooldown;
+  counters[3] = player->freezes_left;
+  counters[4] = player->freezes_cooldown;
+  counters[5] = player->rerolls_left;
+  counters[6] = player->rerolls_cooldown;
+  counters[7] = player->is_frozen_count;
+}
+
+/*
+ * Framed state: symbols and counters are single bytes, names are sent
+ * with their length instead of padded to MAX_PLAYER_NAME_LENGTH and the
+ * state version the snapshot corresponds to comes last.
+ */
+static void encode_framed_state(room_t *room)
+{
+  message_buffer_t *message = &room->state_frame;
+  game_t *game = &room->game;
+  const deck_t *deck = game->deck;
+
+  reset_message_buffer(message);
+  int frame_start = begin_message_frame(message, SEND_GAME_STATE);
+
+  append_message_u8(message, deck->symbols_per_card);
+  append_card_symbols(message, deck, game->current_top_card_index);
+
+  append_message_u8(message, game->players_count);
+  for (int i = 0; i < game->players_count; i++)
+  {
+    player_state_t *player = &game->player_states[i];
+    int name_length = strnlen(room->player_list[i].name, MAX_PLAYER_NAME_LENGTH);
+
+    append_message_u8(message, player->player_id);
+    append_message_u8(message, name_length);
+    append_message_bytes(message, room->player_list[i].name, name_length);
+    append_card_symbols(message, deck, player->current_card_index);
+    read_player_counters(player, (uint8_t *)reserve_message_bytes(message, PLAYER_COUNTERS_COUNT));
+  }
+  append_message_le32(message, room->state_version);
+
+  end_message_frame(message, frame_start);
+  room->state_frame_version = room->state_version;
+}
+
+/*
+ * Serializes the current game state once per protocol spoken in the room,
+ * so every recipient of a broadcast gets the same bytes with a single send.
+ */
+void encode_room_state(room_t *room)
+{
+  if (room->protocol_versions & PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_LEGACY))
+  {
+    encode_legacy_state(room);
+  }
+  if (room->protocol_versions & PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_FRAMED))
+  {
+    encode_framed_state(room);
+  }
+}
+
+/*
+ * Encodes the fields that differ between the last broadcast snapshot and
+ * the current game as a delta from the broadcast version: the top
+ * card if it moved, then each changed seat with a mask of its changed
+ * fields followed by their new values.
+ */
+static void encode_framed_delta(room_t *room)
+{
+  message_buffer_t *message = &room->delta_frame;
+  game_t *game = &room->game;
+  game_t *previous = &room->broadcast_game;
+  const deck_t *deck = game->deck;
+  int top_card_changed = game->current_top_card_index != previous->current_top_card_index;
+
+  reset_message_buffer(message);
+  int frame_start = begin_message_frame(message, SEND_GAME_DELTA);
+
+  append_message_le32(message, room->broadcast_version);
+  append_message_le32(message, room->state_version);
+  append_message_u8(message, top_card_changed);
+  if (top_card_changed)
+  {
+    append_card_symbols(message, deck, game->current_top_card_index);
+  }
+
+  int changed_players_offset = message->length;
+  int changed_players_count = 0;
+  append_message_u8(message, 0);
+
+  for (int i = 0; i < game->players_count; i++)
+  {
+    player_state_t *player = &game->player_states[i];
+    uint8_t counters[PLAYER_COUNTERS_COUNT], previous_counters[PLAYER_COUNTERS_COUNT];
+    int changed_fields = 0;
+
+    read_player_counters(player, counters);
+    read_player_counters(&previous->player_states[i], previous_counters);
+    if (player->current_card_index != previous->player_states[i].current_card_index)
+    {
+      changed_fields |= DELTA_PLAYER_CARD;
+    }
+    for (int j = 0; j < PLAYER_COUNTERS_COUNT; j++)
+    {
+      if (counters[j] != previous_counters[j])
+      {
+        changed_fields |= DELTA_PLAYER_COUNTER(j);
+      }
+    }
+    if (changed_fields == 0)
+    {
+      continue;
+    }
+
+    changed_players_count++;
+    append_message_u8(message, player->player_id);
+    append_message_u8(message, changed_fields & 0xff);
+    append_message_u8(message, changed_fields >> 8);
+    if (changed_fields & DELTA_PLAYER_CARD)
+    {
+      append_card_symbols(message, deck, player->current_card_index);
+    }
+    for (int j = 0; j < PLAYER_COUNTERS_COUNT; j++)
+    {
+      if (changed_fields & DELTA_PLAYER_COUNTER(j))
+      {
+        append_message_u8(message, counters[j]);
+      }
+    }
+  }
+
+  message->data[changed_players_offset] = changed_players_count;
+  end_message_frame(message, frame_start);
+}
+
+static int has_game_changed(game_t *game, game_t *previous)
+{
+  return game->current_top_card_index != previous->current_top_card_index ||
+         memcmp(game->player_states, previous->player_states, game->players_count * sizeof(player_state_t)) != 0;
+}
+
+/*
+ * Takes the snapshot that later deltas are computed against and encodes
+ * the full state, used when a game starts.
+ */
+void reset_room_state(room_t *room)
+{
+  room->state_version++;
+  room->top_card_version = room->state_version;
+  for (int i = 0; i < MAX_GAME_PLAYERS; i++)
+  {
+    room->card_versions[i] = room->state_version;
+  }
+  room->recent_board_hashes[room->state_version % RECENT_STATES_COUNT] = get_board_hash(&room->game);
+  room->broadcast_version = room->state_version;
+  memcpy(&room->broadcast_game, &room->game, sizeof(game_t));
+  memcpy(&room->versioned_game, &room->game, sizeof(game_t));
+  encode_room_state(room);
+}
+
+/*
+ * Records which cards the new state version moved, so actions made
+ * against an older version can be checked for conflicts.
+ */
+static void record_state_changes(room_t *room)
+{
+  game_t *game = &room->game;
+  game_t *previous = &room->versioned_game;
+
+  if (game->current_top_card_index != previous->current_top_card_index)
+  {
+    room->top_card_version = room->state_version;
+  }
+  for (int i = 0; i < game->players_count; i++)
+  {
+    if (game->player_states[i].current_card_index != previous->player_states[i].current_card_index)
+    {
+      room->card_versions[i] = room->state_version;
+    }
+  }
+  room->recent_board_hashes[room->state_version % RECENT_STATES_COUNT] = get_board_hash(game);
+}
+
+/*
+ * Called after every applied action. When the game changed, bumps the
+ * state version so that later actions made against an older version can
+ * be checked against this one. Returns whether anything changed.
+ */
+int commit_room_state(room_t *room)
+{
+  if (!has_game_changed(&room->game, &room->versioned_game))
+  {
+    return 0;
+  }
+
+  room->state_version++;
+  record_state_changes(room);
+  memcpy(&room->versioned_game, &room->game, sizeof(game_t));
+
+  return 1;
+}
+
+/*
+ * Called before a broadcast. When versions were committed since the last
+ * one, encodes the full legacy state and, for framed players, the delta
+ * from the last broadcast snapshot. The framed snapshot is only re-encoded
+ * when someone asks for it. Returns whether anything changed.
+ */
+int publish_room_state(room_t *room)
+{
+  if (room->broadcast_version == room->state_version)
+  {
+    return 0;
+  }
+
+  if (room->protocol_versions & PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_FRAMED))
+  {
+    encode_framed_delta(room);
+  }
+  room->broadcast_version = room->state_version;
+  memcpy(&room->broadcast_game, &room->game, sizeof(game_t));
+  if (room->protocol_versions & PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_LEGACY))
+  {
+    encode_legacy_state(room);
+  }
+
+  return 1;
+}
+
+int update_room_state(room_t *room)
+{
+  commit_room_state(room);
+  return publish_room_state(room);
+}
+
+message_buffer_t *get_room_state_frame(room_t *room)
+{
+  if (room->state_frame_version != room->state_version)
+  {
+    encode_framed_state(room);
+  }
+
+  return &room->state_frame;
+}
+
+/*
+ * Maps the board hash a legacy client sent to the newest of the recent
+ * state versions with that hash. Returns 0 when the hash is unknown.
+ */
+static uint32_t find_board_hash_version(room_t *room, int board_hash)
+{
+  for (uint32_t i = 0; i < RECENT_STATES_COUNT && i < room->state_version; i++)
+  {
+    uint32_t version = room->state_version - i;
+    if (room->recent_board_hashes[version % RECENT_STATES_COUNT] == board_hash)
+    {
+      return version;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * An action made against an older state version is still accepted as long
+ * as none of the cards it depends on moved since then: the top card and
+ * the player's own card for a guess, both cards of a swap and the own card
+ * for a reroll. Freezes depend on no card. Counters are checked by the
+ * game itself.
+ */
+int is_action_current(room_t *room, int player_id, action_t *action)
+{
+  uint32_t version = action->state_version;
+
+  if (version == 0)
+  {
+    version = find_board_hash_version(room, action->board_hash);
+  }
+  if (version == 0 || version > room->state_version)
+  {
+    return 0;
+  }
+
+  switch (action->action_type)
+  {
+  case CARD:
+    return room->top_card_version <= version && room->card_versions[player_id] <= version;
+  case SWAP:
+    return room->card_versions[player_id] <= version &&
+           ((unsigned int)action->id >= MAX_GAME_PLAYERS || room->card_versions[action->id] <= version);
+  case REROLL:
+    return room->card_versions[player_id] <= version;
+  default:
+    return 1;
+  }
+}
+
+/*
+ * Buffers an action until the room's next tick. Every player gets an equal
+ * share of the buffer, so one flooding player cannot crowd out the rest.
+ * Returns 0 when the player already has MAX_TICK_ACTIONS_PER_PLAYER
+ * actions in this tick.
+ */
+int add_tick_action(room_t *room, const room_action_t *room_action)
+{
+  int player_actions_count = 0;
+
+  for (int i = 0; i < room->tick_actions_count; i++)
+  {
+    player_actions_count += room->tick_actions[i].player_id == room_action->player_id;
+  }
+  if (player_actions_count == MAX_TICK_ACTIONS_PER_PLAYER)
+  {
+    return 0;
+  }
+
+  room->tick_actions[room->tick_actions_count++] = *room_action;
+
+  return 1;
+}
+
+/*
+ * Orders the actions buffered during the tick by the time they arrived at
+ * the server, which events from different workers do not reach the queue
+ * in, and empties the buffer. Returns how many actions it held.
+ */
+int take_tick_actions(room_t *room)
+{
+  int count = room->tick_actions_count;
+
+  for (int i = 1; i < count; i++)
+  {
+    room_action_t tick_action = room->tick_actions[i];
+    int j = i;
+    while (j > 0 && room->tick_actions[j - 1].arrived_at > tick_action.arrived_at)
+    {
+      room->tick_actions[j] = room->tick_actions[j - 1];
+      j--;
+    }
+    room->tick_actions[j] = tick_action;
+  }
+  room->tick_actions_count = 0;
+
+  return count;
+}
+
+static void free_room(room_t *room)
+{
+  destroy_message_buffer(&room->state_message);
+  destroy_message_buffer(&room->state_frame);
+  destroy_message_buffer(&room->delta_frame);
+  destroy_game(&room->game);
+  free(room->spectators);
+  pthread_mutex_destroy(&room->journal.mutex);
+  free(room);
+}
+
+void release_room(room_manager_t *manager, room_t *room)
+{
+  if (__atomic_sub_fetch(&room->references, 1, __ATOMIC_ACQ_REL) != 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&manager->mutex);
+  if (room->prev != NULL)
+  {
+    room->prev->next = room->next;
+  }
+  else
+  {
+    manager->rooms = room->next;
+  }
+  if (room->next != NULL)
+  {
+    room->next->prev = room->prev;
+  }
+  manager->rooms_count--;
+  pthread_mutex_unlock(&manager->mutex);
+
+  free_room(room);
+}
+
+void destroy_room_manager(room_manager_t *manager)
+{
+  room_t *room = manager->rooms;
+
+  while (room != NULL)
+  {
+    room_t *next = room->next;
+    free_room(room);
+    room = next;
+  }
+
+  manager->rooms = NULL;
+  manager->rooms_count = 0;
+  pthread_mutex_destroy(&manager->mutex);
+}
@@ -0,0 +1,204 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <pthread.h>
+#include "game.h"
+#include "journal.h"
+#include "mpsc_queue.h"
+#include "protocol.h"
+#include "stats.h"
+
+#define MAX_PLAYER_NAME_LENGTH 32
+#define MAX_PLAYERS MAX_GAME_PLAYERS
+#define DEFAULT_PLAYERS_PER_ROOM 3
+#define RECENT_STATES_COUNT 16
+#define MAX_TICK_ACTIONS_PER_PLAYER 8
+#define MAX_TICK_ACTIONS (MAX_PLAYERS * MAX_TICK_ACTIONS_PER_PLAYER)
+
+struct connection;
+struct worker;
+
+typedef struct
+{
+  int player_id;
+  char name[MAX_PLAYER_NAME_LENGTH];
+  struct connection *connection;
+} player_t;
+
+typedef enum room_event_type
+{
+  PLAYER_JOINED,
+  PLAYER_ACTION,
+  GAME_STATE_REQUESTED,
+  PLAYER_LEFT,
+  ROOM_TICK,
+  SPECTATOR_JOINED,
+  SPECTATOR_LEFT
+} room_event_type_t;
+
+/*
+ * Everything registered in a worker's epoll starts with its source type,
+ * so the worker can tell connections from room tickers.
+ */
+typedef enum poll_source_type
+{
+  CONNECTION_SOURCE,
+  ROOM_TICKER_SOURCE,
+  LISTENER_SOURCE,
+  HANDOFF_SOURCE
+} poll_source_type_t;
+
+typedef struct
+{
+  queue_node_t node;
+  room_event_type_t event_type;
+  int player_id;
+  struct connection *connection;
+  action_t action;
+  uint64_t arrived_at;
+  uint64_t queued_at;
+  uint64_t trace_id;
+  char name[MAX_PLAYER_NAME_LENGTH];
+} room_event_t;
+
+/*
+ * An action made by a player. Its trace id is zero unless it was sampled
+ * for tracing.
+ */
+typedef struct
+{
+  int player_id;
+  action_t action;
+  uint64_t arrived_at;
+  return_code_t return_code;
+  uint64_t trace_id;
+} room_action_t;
+
+/*
+ * Periodic timer of a room in tick mode. It holds a reference on the room
+ * and is torn down by the worker polling it once the room has stopped it.
+ */
+typedef struct
+{
+  poll_source_type_t source_type;
+  int timer_fd;
+  int epoll_fd;
+  int is_stopped;
+  struct room *room;
+} room_ticker_t;
+
+/*
+ * A room is a single-threaded actor. Connections push parsed events to its
+ * queue and whichever thread raises pending_events from zero drains it, so
+ * the game and the player list are only ever touched by one thread at a
+ * time and no lock is held around game logic or broadcasts.
+ */
+typedef struct room
+{
+  int room_id;
+  uint64_t seed;
+  deal_t deal;
+  const deck_t *deck;
+  struct worker *worker;
+  player_t player_list[MAX_PLAYERS];
+  int players_count;
+  int num_players;
+  int ready_players;
+  int has_started;
+  int references;
+  int pending_events;
+  mpsc_queue_t events;
+  game_t game;
+  game_t broadcast_game;
+  game_t versioned_game;
+  uint32_t state_version;
+  uint32_t broadcast_version;
+  uint32_t state_frame_version;
+  uint32_t top_card_version;
+  uint32_t card_versions[MAX_GAME_PLAYERS];
+  int recent_board_hashes[RECENT_STATES_COUNT];
+  message_buffer_t state_message;
+  message_buffer_t state_frame;
+  message_buffer_t delta_frame;
+  int protocol_versions;
+  struct connection **spectators;
+  int spectators_count;
+  int spectators_capacity;
+  int actions_count;
+  room_stats_t stats;
+  room_journal_t journal;
+  int tick_rate;
+  room_ticker_t ticker;
+  room_action_t tick_actions[MAX_TICK_ACTIONS];
+  int tick_actions_count;
+  struct room *prev;
+  struct room *next;
+} room_t;
+
+/*
+ * A tick rate of 0 applies and broadcasts every action as it arrives.
+ */
+typedef struct
+{
+  const deck_t *deck;
+  int tick_rate;
+  int players_per_room;
+} room_config_t;
+
+typedef struct
+{
+  room_t *rooms;
+  int rooms_count;
+  int next_room_id;
+  uint64_t seed_base;
+  room_config_t config;
+  pthread_mutex_t mutex;
+} room_manager_t;
+
+void init_room_manager(room_manager_t *manager, const room_config_t *config);
+
+room_t *create_room(room_manager_t *manager);
+
+int add_room_player(room_t *room);
+
+void retain_room(room_t *room);
+
+room_t *find_room(room_manager_t *manager, int room_id);
+
+void add_room_spectator(room_t *room, struct connection *connection);
+
+void remove_room_spectator(room_t *room, struct connection *connection);
+
+int is_room_ready(room_t *room);
+
+room_event_t *create_room_event(room_event_type_t event_type, int player_id);
+
+int push_room_event(room_t *room, room_event_t *event);
+
+room_event_t *pop_room_event(room_t *room);
+
+int finish_room_events(room_t *room, int processed);
+
+void encode_room_state(room_t *room);
+
+void reset_room_state(room_t *room);
+
+int commit_room_state(room_t *room);
+
+int publish_room_state(room_t *room);
+
+int update_room_state(room_t *room);
+
+int add_tick_action(room_t *room, const room_action_t *room_action);
+
+int take_tick_actions(room_t *room);
+
+message_buffer_t *get_room_state_frame(room_t *room);
+
+int is_action_current(room_t *room, int player_id, action_t *action);
+
+void release_room(room_manager_t *manager, room_t *room);
+
+void destroy_room_manager(room_manager_t *manager);
+
+#endif
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include "game.h"
+#include "room.h"
+
+/*
+ * Bounds on the per-room memory. Raise them only together with the change
+ * that makes a room bigger, so the growth shows up in review.
+ */
+#define MAX_GAME_SIZE (2 * CACHE_LINE_SIZE)
+#define MAX_ROOM_SIZE 9344
+
+static int check_size(const char *name, size_t size, size_t bound)
+{
+  printf("%s: %zu bytes, bound %zu\n", name, size, bound);
+  if (size > bound)
+  {
+    fprintf(stderr, "%s grew past its bound of %zu bytes\n", name, bound);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void)
+{
+  int failures = 0;
+
+  failures += check_size("game_t", sizeof(game_t), MAX_GAME_SIZE);
+  failures += check_size("room_t", sizeof(room_t), MAX_ROOM_SIZE);
+
+  return failures > 0 ? 1 : 0;
+}
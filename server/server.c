@@ -1,377 +1,1707 @@
 #include "server.h"
+#include "handoff.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <time.h>
 #include <unistd.h>
 #include <asm-generic/socket.h>
 #include <string.h>
 
-void init_server_player(player_thread_args_t *arg)
+static void set_nonblocking(int sockfd)
 {
-  player_t *player = arg->player;
-  server_t *server = arg->server;
+  int flags = fcntl(sockfd, F_GETFL, 0);
 
-  send_communication_metadata(server, player->player_id);
-  printf("Sent communication metadata to player %d\n", player->player_id);
+  if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    perror("fcntl failed");
+    exit(1);
+  }
+}
+
+/*
+ * Decks of the common 6-, 8- and 12-symbol variants are built up front so
+ * rooms never pay for generating them.
+ */
+static void init_decks(const server_config_t *config)
+{
+  const int common_symbols_per_card[] = {6, 8, 12};
+
+  for (size_t i = 0; i < sizeof(common_symbols_per_card) / sizeof(common_symbols_per_card[0]); i++)
+  {
+    get_deck(common_symbols_per_card[i]);
+  }
+
+  if (get_deck(config->symbols_per_card) == NULL)
+  {
+    fprintf(stderr, "No deck with %d symbols per card, the card size must be a prime power plus one up to %d\n",
+            config->symbols_per_card, MAX_SYMBOLS_PER_CARD);
+    exit(1);
+  }
+}
+
+void init_server(server_t *server, const server_config_t *config)
+{
+  start_logger();
+  server->config = *config;
+  if (config->trace_path != NULL)
+  {
+    start_tracing(config->trace_path, config->trace_sample_interval);
+  }
+  if (config->journal_path != NULL)
+  {
+    start_journal(config->journal_path);
+  }
+  init_decks(config);
+  room_config_t room_config = {get_deck(config->symbols_per_card), config->tick_rate, config->players_per_room};
+  init_room_manager(&server->room_manager, &room_config);
+
+  server->workers_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (server->workers_count < 1)
+  {
+    server->workers_count = 1;
+  }
+  server->workers = (worker_t *)malloc(server->workers_count * sizeof(worker_t));
+
+  if (server->workers == NULL)
+  {
+    perror("workers malloc failed");
+    exit(1);
+  }
+
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    worker_t *worker = &server->workers[i];
+    worker->source_type = LISTENER_SOURCE;
+    worker->worker_id = i;
+    worker->server = server;
+    worker->listen_fd = -1;
+    worker->handshaking = NULL;
+    worker->handed_over = NULL;
+    worker->accepted_count = 0;
+    worker->rooms_count = 0;
+    worker->started_rooms_count = 0;
+    init_lobby(&worker->lobby);
+
+    if (pthread_mutex_init(&worker->handed_over_mutex, NULL) != 0)
+    {
+      perror("handed over mutex init failed");
+      exit(1);
+    }
+    if ((worker->epoll_fd = epoll_create1(0)) < 0)
+    {
+      perror("epoll_create1 failed");
+      exit(1);
+    }
+  }
+
+  server->handoff_source = HANDOFF_SOURCE;
+  server->handoff_fd = -1;
+  server->handoff_listen_fd = -1;
+}
+
+/*
+ * Every worker listens on the port with its own SO_REUSEPORT socket, so
+ * the kernel spreads new connections over the workers and no thread
+ * accepts on behalf of the others.
+ */
+static void open_listener(server_t *server, worker_t *worker)
+{
+  int opt = 1;
+
+  if ((worker->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+  {
+    perror("socket failed");
+    exit(1);
+  }
+
+  if (setsockopt(worker->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+      setsockopt(worker->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+  {
+    perror("setsockopt failed");
+    exit(1);
+  }
+
+  if (bind(worker->listen_fd, (struct sockaddr *)&server->address, sizeof(server->address)) < 0)
+  {
+    perror("bind failed");
+    exit(1);
+  }
+
+  if (listen(worker->listen_fd, SOMAXCONN) < 0)
+  {
+    perror("listen failed");
+    exit(1);
+  }
+
+  set_nonblocking(worker->listen_fd);
+  register_listener(worker);
+}
+
+void register_listener(worker_t *worker)
+{
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.ptr = worker;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &event) < 0)
+  {
+    perror("epoll_ctl failed");
+    exit(1);
+  }
+}
+
+void run_server(server_t *server)
+{
+  server->address.sin_family = AF_INET;
+  server->address.sin_addr.s_addr = INADDR_ANY;
+  server->address.sin_port = htons(PORT);
+
+  receive_handoff(server);
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    if (server->workers[i].listen_fd < 0)
+    {
+      open_listener(server, &server->workers[i]);
+    }
+  }
+
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    if (pthread_create(&server->workers[i].thread, NULL, worker_thread, (void *)&server->workers[i]) != 0)
+    {
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+  LOG_INFO("Started %d worker threads\n", server->workers_count);
+  LOG_INFO("Each room takes %zu bytes, %zu of them for the game state\n", sizeof(room_t), sizeof(game_t));
+  LOG_INFO("Rooms start with %d players\n", server->config.players_per_room);
+  if (server->config.tick_rate > 0)
+  {
+    LOG_INFO("Rooms resolve actions %d times per second\n", server->config.tick_rate);
+  }
+  LOG_INFO("Server is listening for players on port %d\n", PORT);
+  if (server->config.handoff_path != NULL)
+  {
+    start_handoff_listener(server);
+  }
+
+  report_worker_stats(server);
+}
+
+/*
+ * Pins the worker to one core, so its connections, rooms and their caches
+ * stay on it. Failing to pin, e.g. in a restricted cpuset, is not fatal.
+ */
+static void pin_worker_thread(worker_t *worker)
+{
+  long cpus_count = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(worker->worker_id % (cpus_count > 0 ? cpus_count : 1), &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+  {
+    LOG_WARN("Could not pin worker %d to a core\n", worker->worker_id);
+  }
+}
+
+void *worker_thread(void *arg)
+{
+  worker_t *worker = (worker_t *)arg;
+  server_t *server = worker->server;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+
+  pin_worker_thread(worker);
+  register_thread_stats(worker->worker_id);
+  register_trace_thread(worker->worker_id);
+
+  while (1)
+  {
+    int events_count = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+
+    if (events_count < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("epoll_wait failed");
+      exit(1);
+    }
+
+    for (int i = 0; i < events_count; i++)
+    {
+      poll_source_type_t source_type = *(poll_source_type_t *)events[i].data.ptr;
+
+      if (source_type == LISTENER_SOURCE)
+      {
+        accept_connections(worker);
+        continue;
+      }
+      if (source_type == ROOM_TICKER_SOURCE)
+      {
+        handle_room_ticker(server, (room_ticker_t *)events[i].data.ptr);
+        continue;
+      }
+      if (source_type == HANDOFF_SOURCE)
+      {
+        park_worker_for_handoff(server);
+        continue;
+      }
+
+      connection_t *connection = (connection_t *)events[i].data.ptr;
+
+      if (connection->next_worker != NULL)
+      {
+        adopt_connection(server, connection);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT)
+      {
+        connection_flush(connection);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      {
+        handle_connection_input(server, connection);
+      }
+      else if (connection_should_close(connection))
+      {
+        close_connection(server, connection);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Accepts every pending connection on the worker's own listener. The
+ * connection stays on this worker for its whole life, handshakes are read
+ * here and rooms are formed in the worker's lobby, so new players keep
+ * coming in while games run. Only spectators of a room on another worker
+ * move, to the worker of that room.
+ */
+void accept_connections(worker_t *worker)
+{
+  while (1)
+  {
+    int new_socket = accept4(worker->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+
+    if (new_socket < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+      {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        perror("accept failed");
+      }
+      return;
+    }
+
+    __atomic_fetch_add(&worker->accepted_count, 1, __ATOMIC_RELAXED);
+    connection_t *connection = create_connection(new_socket);
+    connection->worker = worker;
+
+    send_communication_metadata(connection);
+    LOG_DEBUG("Sent communication metadata to a new connection on worker %d\n", worker->worker_id);
+
+    add_handshaking_connection(worker, connection);
+    register_connection(connection);
+  }
+}
+
+void register_connection(connection_t *connection)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = connection;
+
+  if (epoll_ctl(connection->worker->epoll_fd, EPOLL_CTL_ADD, connection->sockfd, &event) < 0)
+  {
+    perror("epoll_ctl failed");
+    exit(1);
+  }
+}
+
+/*
+ * Connections that have not finished their handshake are only known to
+ * the worker that accepted them, which keeps them in its own list so a
+ * handoff can find them.
+ */
+static void link_connection(connection_t **first, connection_t *connection)
+{
+  connection->handshake_prev = NULL;
+  connection->handshake_next = *first;
+  if (*first != NULL)
+  {
+    (*first)->handshake_prev = connection;
+  }
+  *first = connection;
+}
+
+static void unlink_connection(connection_t **first, connection_t *connection)
+{
+  if (connection->handshake_prev != NULL)
+  {
+    connection->handshake_prev->handshake_next = connection->handshake_next;
+  }
+  else
+  {
+    *first = connection->handshake_next;
+  }
+  if (connection->handshake_next != NULL)
+  {
+    connection->handshake_next->handshake_prev = connection->handshake_prev;
+  }
+  connection->handshake_prev = NULL;
+  connection->handshake_next = NULL;
+}
+
+void add_handshaking_connection(worker_t *worker, connection_t *connection)
+{
+  link_connection(&worker->handshaking, connection);
+}
+
+static void remove_handshaking_connection(connection_t *connection)
+{
+  unlink_connection(&connection->worker->handshaking, connection);
+}
+
+/*
+ * A handed over connection is still handshaking, with its hello unparsed,
+ * and waits in the list of its new worker until that worker adopts it.
+ */
+void add_handed_over_connection(worker_t *worker, connection_t *connection)
+{
+  connection->next_worker = worker;
+  pthread_mutex_lock(&worker->handed_over_mutex);
+  link_connection(&worker->handed_over, connection);
+  pthread_mutex_unlock(&worker->handed_over_mutex);
+}
+
+/*
+ * Moves a handshaking connection to the worker it asked for. It is polled
+ * there last, after which this worker must not touch it again. The socket
+ * is writable, so the new worker gets an event for it right away.
+ */
+static void hand_over_connection(connection_t *connection)
+{
+  worker_t *worker = connection->next_worker;
+
+  epoll_ctl(connection->worker->epoll_fd, EPOLL_CTL_DEL, connection->sockfd, NULL);
+  remove_handshaking_connection(connection);
+  connection->worker = worker;
+  add_handed_over_connection(worker, connection);
+  register_connection(connection);
+}
+
+static void write_worker_stats_json(FILE *file, server_t *server, thread_stats_t *stats)
+{
+  uint64_t actions_count = __atomic_load_n(&stats->actions_count, __ATOMIC_RELAXED);
+  uint64_t send_calls = __atomic_load_n(&stats->send_calls, __ATOMIC_RELAXED);
+  uint64_t bytes_sent = __atomic_load_n(&stats->bytes_sent, __ATOMIC_RELAXED);
+  worker_t *worker = &server->workers[stats->worker_id];
+
+  fprintf(file, "{\"worker_id\":%d,\"rooms\":%d,\"accepted\":%lld,\"actions\":%llu,\"send_calls\":%llu,"
+                "\"bytes_sent\":%llu,\"send_calls_per_action\":%.3f,\"bytes_per_action\":%.1f,",
+          stats->worker_id, __atomic_load_n(&worker->rooms_count, __ATOMIC_RELAXED),
+          __atomic_load_n(&worker->accepted_count, __ATOMIC_RELAXED), (unsigned long long)actions_count,
+          (unsigned long long)send_calls, (unsigned long long)bytes_sent,
+          actions_count > 0 ? (double)send_calls / actions_count : 0.0,
+          actions_count > 0 ? (double)bytes_sent / actions_count : 0.0);
+  write_return_codes_json(file, stats->return_codes, actions_count);
+  for (int i = 0; i < STATS_HISTOGRAMS_COUNT; i++)
+  {
+    fputc(',', file);
+    write_histogram_json(file, stats_histogram_names[i], &stats->histograms[i]);
+  }
+  fputc('}', file);
+}
+
+static void write_room_stats_json(FILE *file, room_t *room)
+{
+  uint64_t actions_count = __atomic_load_n(&room->stats.actions_count, __ATOMIC_RELAXED);
+
+  fprintf(file, "{\"room_id\":%d,\"worker_id\":%d,\"spectators\":%d,\"actions\":%llu,", room->room_id,
+          room->worker != NULL ? room->worker->worker_id : -1, __atomic_load_n(&room->spectators_count, __ATOMIC_RELAXED),
+          (unsigned long long)actions_count);
+  write_return_codes_json(file, room->stats.return_codes, actions_count);
+  fputc(',', file);
+  write_histogram_json(file, stats_histogram_names[ACTION_LATENCY], &room->stats.action_latency);
+  fputc(',', file);
+  write_histogram_json(file, stats_histogram_names[BROADCAST_DURATION], &room->stats.broadcast_duration);
+  fputc('}', file);
+}
+
+/*
+ * Writes the counters and histograms of every worker and every live room
+ * as one JSON object. The file is replaced atomically, so a scraper never
+ * reads half a snapshot. Values are cumulative since the server started.
+ */
+static void write_stats_snapshot(server_t *server)
+{
+  char temporary_path[PATH_MAX];
+  int is_first = 1;
+
+  snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", server->config.stats_path);
+  FILE *file = fopen(temporary_path, "w");
+  if (file == NULL)
+  {
+    LOG_WARN("Could not open the stats snapshot file\n");
+    return;
+  }
+
+  fprintf(file, "{\"timestamp_ns\":%llu,\"log_drops\":%llu,\"workers\":[", (unsigned long long)stats_now_ns(),
+          read_log_drops());
+  for (thread_stats_t *stats = get_all_thread_stats(); stats != NULL; stats = stats->next)
+  {
+    fprintf(file, "%s", is_first ? "" : ",");
+    write_worker_stats_json(file, server, stats);
+    is_first = 0;
+  }
+
+  fprintf(file, "],\"rooms\":[");
+  pthread_mutex_lock(&server->room_manager.mutex);
+  for (room_t *room = server->room_manager.rooms; room != NULL; room = room->next)
+  {
+    write_room_stats_json(file, room);
+    fprintf(file, "%s", room->next != NULL ? "," : "");
+  }
+  pthread_mutex_unlock(&server->room_manager.mutex);
+  fprintf(file, "]}\n");
+
+  if (fclose(file) != 0 || rename(temporary_path, server->config.stats_path) != 0)
+  {
+    LOG_WARN("Could not write the stats snapshot file\n");
+  }
+}
+
+/*
+ * Hands the records every room has buffered so far to the journal writer,
+ * so a crash does not take the games in progress with it.
+ */
+void flush_room_journals(server_t *server)
+{
+  pthread_mutex_lock(&server->room_manager.mutex);
+  for (room_t *room = server->room_manager.rooms; room != NULL; room = room->next)
+  {
+    flush_room_journal(&room->journal);
+  }
+  pthread_mutex_unlock(&server->room_manager.mutex);
+}
+
+/*
+ * Runs on the main thread once the workers are up. Rewrites the stats
+ * snapshot and flushes the journal every STATS_SNAPSHOT_INTERVAL_SECONDS
+ * when they are enabled, and prints, for every worker, how many rooms it
+ * hosts and its accept and room start rates.
+ */
+void report_worker_stats(server_t *server)
+{
+  long long *accepted_counts = (long long *)calloc(server->workers_count, sizeof(long long));
+  long long *started_rooms_counts = (long long *)calloc(server->workers_count, sizeof(long long));
+
+  if (accepted_counts == NULL || started_rooms_counts == NULL)
+  {
+    perror("worker stats calloc failed");
+    exit(1);
+  }
+
+  for (int tick = 1;; tick++)
+  {
+    sleep(STATS_SNAPSHOT_INTERVAL_SECONDS);
+
+    if (server->config.stats_path != NULL)
+    {
+      write_stats_snapshot(server);
+    }
+    if (is_journaling())
+    {
+      flush_room_journals(server);
+    }
+    write_trace_spans();
+    if (tick % (WORKER_STATS_INTERVAL_SECONDS / STATS_SNAPSHOT_INTERVAL_SECONDS) != 0)
+    {
+      continue;
+    }
+
+    for (int i = 0; i < server->workers_count; i++)
+    {
+      worker_t *worker = &server->workers[i];
+      long long accepted_count = __atomic_load_n(&worker->accepted_count, __ATOMIC_RELAXED);
+      long long started_rooms_count = __atomic_load_n(&worker->started_rooms_count, __ATOMIC_RELAXED);
+
+      LOG_TEXT(LOG_LEVEL_INFO, "Worker %d: %d rooms, %.1f accepts/s, %.1f rooms started/s\n", worker->worker_id,
+               __atomic_load_n(&worker->rooms_count, __ATOMIC_RELAXED),
+               (double)(accepted_count - accepted_counts[i]) / WORKER_STATS_INTERVAL_SECONDS,
+               (double)(started_rooms_count - started_rooms_counts[i]) / WORKER_STATS_INTERVAL_SECONDS);
+      accepted_counts[i] = accepted_count;
+      started_rooms_counts[i] = started_rooms_count;
+    }
+  }
+}
+
+static uint64_t monotonic_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Players in the lobby have no room yet and are reported in room -1.
+ */
+static int connection_room_id(connection_t *connection)
+{
+  room_t *room = __atomic_load_n(&connection->room, __ATOMIC_ACQUIRE);
+  return room != NULL ? room->room_id : -1;
+}
+
+/*
+ * The first message of a connection is either the bare name of a legacy
+ * client, taken from the first read like the blocking server did, the
+ * hello of a framed client, which switches the connection to frames, or
+ * the hello of a spectator. A spectator of a room on another worker is
+ * handed over to that worker with its hello unconsumed.
+ */
+static int handle_handshake(server_t *server, connection_t *connection, const char *buffer, int length)
+{
+  const char *name = buffer;
+  int name_length = length < MAX_PLAYER_NAME_LENGTH ? length : MAX_PLAYER_NAME_LENGTH;
+  int consumed = name_length;
+
+  if (buffer[0] == PROTOCOL_SPECTATE_MAGIC)
+  {
+    int version;
+    int room_id;
+
+    consumed = parse_spectate_hello(buffer, length, &version, &room_id);
+    if (consumed <= 0)
+    {
+      return consumed;
+    }
+    if (version != PROTOCOL_VERSION_FRAMED)
+    {
+      return -1;
+    }
+
+    room_t *room = find_room(&server->room_manager, room_id);
+    if (room != NULL && room->worker != connection->worker)
+    {
+      /* The worker of the room parses the hello again once it adopts it. */
+      connection->next_worker = room->worker;
+      release_room(&server->room_manager, room);
+      return 0;
+    }
+    connection->protocol_version = PROTOCOL_VERSION_FRAMED;
+    connection->is_spectator = 1;
+    connection->state = AWAITING_REQUESTS;
+    remove_handshaking_connection(connection);
+    handle_spectator(server, connection, room, room_id);
+    return consumed;
+  }
+  if (buffer[0] == PROTOCOL_HELLO_MAGIC)
+  {
+    int version;
+
+    consumed = parse_hello(buffer, length, &version, &name, &name_length);
+    if (consumed <= 0)
+    {
+      return consumed;
+    }
+    if (version != PROTOCOL_VERSION_FRAMED || name_length > MAX_PLAYER_NAME_LENGTH)
+    {
+      return -1;
+    }
+    connection->protocol_version = PROTOCOL_VERSION_FRAMED;
+  }
+
+  connection->state = AWAITING_REQUESTS;
+  remove_handshaking_connection(connection);
+  handle_player_name(server, connection, name, name_length);
+
+  return consumed;
+}
+
+/*
+ * Handles every complete message in the input buffer, parsing requests in
+ * place, and keeps a partial trailing message for the next read. Returns
+ * -1 when the stream is invalid or holds a message that can never fit.
+ */
+static int handle_buffered_input(server_t *server, connection_t *connection)
+{
+  int offset = 0;
+
+  while (offset < connection->input_length)
+  {
+    const char *buffer = connection->input + offset;
+    int length = connection->input_length - offset;
+    int consumed;
+
+    if (connection->state == AWAITING_PLAYER_NAME)
+    {
+      consumed = handle_handshake(server, connection, buffer, length);
+    }
+    else
+    {
+      request_t request;
+      uint64_t parse_started_at = IS_TRACING() ? stats_now_ns() : 0;
+
+      if (connection->protocol_version == PROTOCOL_VERSION_FRAMED)
+      {
+        consumed = parse_frame(buffer, length, &request);
+      }
+      else
+      {
+        consumed = parse_request(buffer, length, &request);
+      }
+      if (consumed > 0 && connection->is_spectator && request.request_type == MAKE_ACTION)
+      {
+        consumed = -1;
+      }
+      if (consumed > 0)
+      {
+        uint64_t trace_id = 0;
+
+        if (IS_TRACING() && request.request_type == MAKE_ACTION)
+        {
+          trace_id = sample_trace_id();
+          TRACE_SPAN(trace_id, TRACE_PARSE, parse_started_at, connection_room_id(connection), connection->player_id);
+        }
+        handle_request(server, connection, &request, trace_id);
+      }
+    }
+
+    if (consumed < 0)
+    {
+      return -1;
+    }
+    if (consumed == 0)
+    {
+      break;
+    }
+    offset += consumed;
+  }
+
+  memmove(connection->input, connection->input + offset, connection->input_length - offset);
+  connection->input_length -= offset;
+
+  return connection->input_length < CONNECTION_INPUT_BUFFER_SIZE ? 0 : -1;
+}
+
+/*
+ * Returns -1 once the connection was closed or handed over to another
+ * worker, after which this worker must leave it alone.
+ */
+static int handle_received_input(server_t *server, connection_t *connection)
+{
+  if (handle_buffered_input(server, connection) < 0)
+  {
+    LOG_WARN("Invalid request from player %d in room %d\n", connection->player_id, connection_room_id(connection));
+    close_connection(server, connection);
+    return -1;
+  }
+  if (connection->next_worker != NULL)
+  {
+    hand_over_connection(connection);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Drains the socket of an edge-triggered connection into its input buffer
+ * and feeds everything through the incremental parsers.
+ */
+void handle_connection_input(server_t *server, connection_t *connection)
+{
+  while (1)
+  {
+    int received = recv(connection->sockfd, connection->input + connection->input_length,
+                        CONNECTION_INPUT_BUFFER_SIZE - connection->input_length, 0);
+
+    if (received > 0)
+    {
+      connection->input_length += received;
+      if (handle_received_input(server, connection) < 0)
+      {
+        return;
+      }
+      continue;
+    }
+
+    if (received == 0)
+    {
+      LOG_INFO("Player %d in room %d disconnected\n", connection->player_id, connection_room_id(connection));
+      close_connection(server, connection);
+      return;
+    }
+    if (errno == EINTR)
+    {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      perror("recv failed");
+      close_connection(server, connection);
+      return;
+    }
+    break;
+  }
+
+  if (connection_should_close(connection))
+  {
+    close_connection(server, connection);
+  }
+}
+
+/*
+ * Takes a connection handed over by another worker, or by the server this
+ * one took over from, and parses the input it arrived with.
+ */
+void adopt_connection(server_t *server, connection_t *connection)
+{
+  worker_t *worker = connection->worker;
+
+  pthread_mutex_lock(&worker->handed_over_mutex);
+  unlink_connection(&worker->handed_over, connection);
+  connection->next_worker = NULL;
+  pthread_mutex_unlock(&worker->handed_over_mutex);
+
+  add_handshaking_connection(worker, connection);
+  if (connection->input_length > 0 && handle_received_input(server, connection) < 0)
+  {
+    return;
+  }
+  handle_connection_input(server, connection);
+}
+
+/*
+ * Seats the longest waiting players of the worker's lobby in a new room
+ * once enough of them are waiting. Players are never matched across
+ * workers, so the room runs on the thread that owns all its players.
+ */
+static void match_waiting_players(server_t *server, worker_t *worker)
+{
+  connection_t *connections[MAX_PLAYERS];
+  int players_count = server->config.players_per_room;
+  int is_actor = 0;
+
+  if (take_waiting_connections(&worker->lobby, connections, players_count) == 0)
+  {
+    return;
+  }
+
+  room_t *room = create_room(&server->room_manager);
+  room->worker = worker;
+  for (int i = 0; i < players_count; i++)
+  {
+    connection_t *connection = connections[i];
+    connection->player_id = add_room_player(room);
+    __atomic_store_n(&connection->room, room, __ATOMIC_RELEASE);
+
+    room_event_t *event = create_room_event(PLAYER_JOINED, connection->player_id);
+    event->connection = connection;
+    memcpy(event->name, connection->name, MAX_PLAYER_NAME_LENGTH);
+    event->queued_at = stats_now_ns();
+    is_actor |= push_room_event(room, event);
+  }
+  LOG_INFO("Worker %d formed room %d, %lld players matched so far and %d waiting\n", worker->worker_id,
+           room->room_id, worker->lobby.matched_count, worker->lobby.waiting_count);
+
+  __atomic_fetch_add(&worker->rooms_count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&worker->started_rooms_count, 1, __ATOMIC_RELAXED);
+  if (is_actor)
+  {
+    run_room_events(server, room);
+  }
+  release_room(&server->room_manager, room);
+}
+
+void handle_player_name(server_t *server, connection_t *connection, const char *name, int length)
+{
+  memset(connection->name, 0, MAX_PLAYER_NAME_LENGTH);
+  memcpy(connection->name, name, length);
+
+  add_waiting_connection(&connection->worker->lobby, connection);
+  match_waiting_players(server, connection->worker);
+}
+
+/*
+ * Subscribes a spectator to the room it asked for, which the caller found
+ * on this worker and holds a reference to. Asking for a room that does
+ * not exist, or no longer does, gets it a finish notification.
+ */
+void handle_spectator(server_t *server, connection_t *connection, room_t *room, int room_id)
+{
+  if (room == NULL)
+  {
+    char frame[FRAME_HEADER_SIZE];
+
+    LOG_INFO("A spectator asked for room %d, which does not exist\n", room_id);
+    connection_send(connection, frame, write_frame_header(frame, FINISH_GAME, 0));
+    connection_close_after_flush(connection);
+    return;
+  }
+
+  __atomic_store_n(&connection->room, room, __ATOMIC_RELEASE);
+  room_event_t *event = create_room_event(SPECTATOR_JOINED, connection->player_id);
+  event->connection = connection;
+  dispatch_room_event(server, room, event);
+}
+
+void handle_request(server_t *server, connection_t *connection, request_t *request, uint64_t trace_id)
+{
+  room_t *room = __atomic_load_n(&connection->room, __ATOMIC_ACQUIRE);
+
+  if (room == NULL)
+  {
+    if (request->request_type == FINISH_GAME)
+    {
+      connection_close_after_flush(connection);
+    }
+    return;
+  }
+
+  LOG_DEBUG("Received request type %d from player %d in room %d\n", request->request_type, connection->player_id, room->room_id);
 
-  char buffer[128] = {0};
-  recv(player->sockfd, buffer, MAX_PLAYER_NAME_LENGTH, 0);
-  strcpy(player->name, buffer);
+  if (request->request_type == MAKE_ACTION)
+  {
+    room_event_t *event = create_room_event(PLAYER_ACTION, connection->player_id);
+    event->action = request->action;
+    event->arrived_at = monotonic_now_ns();
+    event->trace_id = trace_id;
+    dispatch_room_event(server, room, event);
+  }
+  else if (request->request_type == SEND_GAME_STATE)
+  {
+    room_event_t *event = create_room_event(GAME_STATE_REQUESTED, connection->player_id);
+    event->connection = connection;
+    dispatch_room_event(server, room, event);
+  }
+  else if (request->request_type == FINISH_GAME)
+  {
+    connection_close_after_flush(connection);
+  }
+
+  LOG_DEBUG("Finished processing request type %d from player %d in room %d\n", request->request_type, connection->player_id, room->room_id);
+}
 
-  printf("Received player name: %s\n", player->name);
+/*
+ * Stops polling the connection and hands it to its room, which frees it
+ * once every event queued before the departure has been processed. A
+ * connection still in the lobby is freed right away.
+ */
+void close_connection(server_t *server, connection_t *connection)
+{
+  epoll_ctl(connection->worker->epoll_fd, EPOLL_CTL_DEL, connection->sockfd, NULL);
+  if (connection->state == AWAITING_PLAYER_NAME)
+  {
+    remove_handshaking_connection(connection);
+  }
 
-  send_game_metadata(server, player->player_id);
-  printf("Sent game metadata to player %d\n", player->player_id);
+  room_t *room = connection->room;
+  remove_waiting_connection(&connection->worker->lobby, connection);
 
-  if (write(server->pipe_fds[PLAYER_PIPES_START + player->player_id][PIPE_WRITE], player->name, MAX_PLAYER_NAME_LENGTH) < 0)
+  if (room == NULL)
   {
-    perror("write failed");
-    exit(1);
+    destroy_connection(connection);
+    return;
+  }
+
+  room_event_t *event = create_room_event(connection->is_spectator ? SPECTATOR_LEFT : PLAYER_LEFT, connection->player_id);
+  event->connection = connection;
+  dispatch_room_event(server, room, event);
+
+  release_room(&server->room_manager, room);
+}
+
+/*
+ * Turns timer expirations into tick events for the room. Once the room has
+ * stopped its ticker, the worker polling it closes the timer and drops the
+ * ticker's reference on the room.
+ */
+void handle_room_ticker(server_t *server, room_ticker_t *ticker)
+{
+  room_t *room = ticker->room;
+  uint64_t expirations;
+
+  if (__atomic_load_n(&ticker->is_stopped, __ATOMIC_ACQUIRE))
+  {
+    epoll_ctl(ticker->epoll_fd, EPOLL_CTL_DEL, ticker->timer_fd, NULL);
+    close(ticker->timer_fd);
+    release_room(&server->room_manager, room);
+    return;
   }
 
-  int opt = 0;
-  if (read(server->pipe_fds[START_GAME_PIPE][PIPE_READ], &opt, sizeof(opt)) < 0)
+  if (read(ticker->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
   {
-    perror("read failed");
-    exit(1);
+    return;
+  }
+
+  dispatch_room_event(server, room, create_room_event(ROOM_TICK, 0));
+}
+
+void dispatch_room_event(server_t *server, room_t *room, room_event_t *event)
+{
+  event->queued_at = stats_now_ns();
+  if (push_room_event(room, event))
+  {
+    run_room_events(server, room);
+  }
+}
+
+/*
+ * Drains the room's queue on behalf of the thread that became its actor.
+ */
+void run_room_events(server_t *server, room_t *room)
+{
+  room_event_t *event;
+
+  (void)server;
+
+  do
+  {
+    event = pop_room_event(room);
+    record_thread_duration(ROOM_QUEUE_WAIT, stats_now_ns() - event->queued_at);
+    TRACE_SPAN(event->trace_id, TRACE_QUEUE_WAIT, event->queued_at, room->room_id, event->player_id);
+    process_room_event(room, event);
+    free(event);
+  } while (finish_room_events(room, 1));
+}
+
+/*
+ * Journals the deal of a game that is starting: the seed, the deck and the
+ * card order the seed produced.
+ */
+static void open_room_journal(room_t *room)
+{
+  journal_record_t record;
+
+  if (!is_journaling())
+  {
+    return;
   }
+
+  record.record_type = ROOM_STARTED;
+  record.room_id = room->room_id;
+  record.timestamp_ns = stats_now_ns();
+  record.payload.started.seed = room->seed;
+  record.payload.started.symbols_per_card = room->deck->symbols_per_card;
+  record.payload.started.players_count = room->game.players_count;
+  record.payload.started.cards_count = room->deck->cards_count;
+  record.payload.started.card_order = room->deal.card_order;
+  room->journal.is_open = 1;
+  append_journal_record(&room->journal, &record);
 }
 
-void *player_thread(void *arg)
+static void journal_room_action(room_t *room, const room_action_t *room_action)
 {
-  player_thread_args_t *args = (player_thread_args_t *)arg;
-  player_t *player = args->player;
+  journal_record_t record;
+
+  if (!room->journal.is_open)
+  {
+    return;
+  }
 
-  init_server_player(args);
+  record.record_type = ACTION_MADE;
+  record.room_id = room->room_id;
+  record.timestamp_ns = room_action->arrived_at;
+  record.payload.action.player_id = room_action->player_id;
+  record.payload.action.return_code = room_action->return_code;
+  record.payload.action.action_type = room_action->action.action_type;
+  record.payload.action.id = room_action->action.id;
+  append_journal_record(&room->journal, &record);
+}
 
-  printf("Received game start signal for player %d\n", player->player_id);
+/*
+ * Journals the final board hash once the game has finished or everybody
+ * left, and hands the rest of the room's journal to the writer.
+ */
+void close_room_journal(room_t *room)
+{
+  journal_record_t record;
 
-  send_game_state(args->server, args->game, player->player_id);
+  if (!room->journal.is_open)
+  {
+    return;
+  }
 
-  printf("Sent game state to player %d\n", player->player_id);
+  record.record_type = ROOM_FINISHED;
+  record.room_id = room->room_id;
+  record.timestamp_ns = stats_now_ns();
+  record.payload.finished.board_hash = get_board_hash(&room->game);
+  record.payload.finished.has_finished = room->game.has_finished;
+  append_journal_record(&room->journal, &record);
+  flush_room_journal(&room->journal);
+  room->journal.is_open = 0;
+}
 
-  while (1)
-  { 
-    request_type_t request_type;
-    int response = recv(player->sockfd, &request_type, sizeof(request_type), 0);
-    
-    if (response < 0)
-    {
-      perror("recv failed");
-      exit(1);
-    }
+/*
+ * Spectators have no seat. They get the metadata and the current state
+ * when they join and then follow the room's broadcasts.
+ */
+static void process_spectator_event(room_t *room, room_event_t *event)
+{
+  connection_t *connection = event->connection;
+
+  switch (event->event_type)
+  {
+  case SPECTATOR_JOINED:
+    add_room_spectator(room, connection);
+    room->protocol_versions |= PROTOCOL_VERSION_BIT(PROTOCOL_VERSION_FRAMED);
+    send_spectator_metadata(room, connection);
+    send_spectator_state(room, connection);
+    LOG_INFO("A spectator joined room %d, %d watching\n", room->room_id, room->spectators_count);
+    break;
+  case GAME_STATE_REQUESTED:
+    send_spectator_state(room, connection);
+    break;
+  case SPECTATOR_LEFT:
+    remove_room_spectator(room, connection);
+    destroy_connection(connection);
+    LOG_INFO("A spectator left room %d, %d watching\n", room->room_id, room->spectators_count);
+    break;
+  default:
+    break;
+  }
+}
 
-    printf("Received request type %d from player %d\n", request_type, player->player_id);
+void process_room_event(room_t *room, room_event_t *event)
+{
+  if (event->connection != NULL && event->connection->is_spectator)
+  {
+    process_spectator_event(room, event);
+    return;
+  }
+
+  player_t *player = &room->player_list[event->player_id];
+
+  switch (event->event_type)
+  {
+  case PLAYER_JOINED:
+    player->connection = event->connection;
+    room->protocol_versions |= PROTOCOL_VERSION_BIT(event->connection->protocol_version);
+    memcpy(player->name, event->name, MAX_PLAYER_NAME_LENGTH);
+    LOG_TEXT(LOG_LEVEL_INFO, "Received player name: %.*s\n", MAX_PLAYER_NAME_LENGTH, player->name);
+
+    send_game_metadata(room, player->player_id);
+    LOG_DEBUG("Sent game metadata to player %d in room %d\n", player->player_id, room->room_id);
 
-    if (request_type == MAKE_ACTION)
+    room->ready_players++;
+    if (is_room_ready(room))
     {
-      receive_game_action(args->server, args->game, player->player_id);
-      if (args->game->has_finished)
-      {
-        break;
-      }
+      start_room_game(room);
     }
-    else if (request_type == SEND_GAME_STATE)
+    break;
+  case PLAYER_ACTION:
+  {
+    room_action_t room_action = {event->player_id, event->action, event->arrived_at, ERROR, event->trace_id};
+    receive_game_action(room, &room_action);
+    break;
+  }
+  case ROOM_TICK:
+    run_room_tick(room);
+    break;
+  case GAME_STATE_REQUESTED:
+    if (room->has_started)
     {
-      send_game_state(args->server, args->game, player->player_id);
+      send_game_state(room, event->player_id);
     }
-    else if (request_type == FINISH_GAME)
+    break;
+  case PLAYER_LEFT:
+    if (player->connection == event->connection)
     {
-      break;
+      player->connection = NULL;
     }
-    else
+    destroy_connection(event->connection);
+    LOG_INFO("Player %d left room %d\n", event->player_id, room->room_id);
+
+    if (room_connections_count(room) == 0)
     {
-      perror("Invalid request type");
-      exit(1);
+      __atomic_fetch_sub(&room->worker->rooms_count, 1, __ATOMIC_RELAXED);
     }
 
-    printf("Finished processing request type %d from player %d\n", request_type, player->player_id);
+    if (room->has_started && room_connections_count(room) == 0)
+    {
+      stop_room_ticker(room);
+      close_room_journal(room);
+      if (!room->game.has_finished)
+      {
+        send_spectators_finish(room);
+      }
+      connection_counters_t counters;
+      read_connection_counters(&counters);
+      LOG_INFO("Room %d is empty after %d actions, %lu send calls and %lu bytes sent by the server so far\n",
+               room->room_id, room->actions_count, counters.send_calls, counters.bytes_sent);
+    }
+    break;
+  case SPECTATOR_JOINED:
+  case SPECTATOR_LEFT:
+    break;
   }
-
-  close(player->sockfd);
-
-  return NULL;
 }
 
-void init_server(server_t *server)
+int room_connections_count(room_t *room)
 {
-  server->num_players = 0;
-
-  server->player_list = (player_t *)malloc(MAX_PLAYERS * sizeof(player_t));
+  int count = 0;
 
-  if (server->player_list == NULL)
+  for (int i = 0; i < MAX_PLAYERS; i++)
   {
-    perror("player list malloc failed");
-    exit(1);
+    if (room->player_list[i].connection != NULL)
+    {
+      count++;
+    }
   }
 
-  server->player_threads = (pthread_t *)malloc(MAX_PLAYERS * sizeof(pthread_t));
+  return count;
+}
+
+void start_room_game(room_t *room)
+{
+  deal_cards(&room->deal, room->deck, room->seed);
+  init_game(&room->game, room->deck, &room->deal, room->players_count);
+  room->has_started = 1;
+  reset_room_state(room);
+  open_room_journal(room);
+  LOG_INFO("Started game in room %d with seed %llu\n", room->room_id, (unsigned long long)room->seed);
 
-  if (server->player_threads == NULL)
+  for (int i = 0; i < room->game.players_count; i++)
   {
-    perror("player threads malloc failed");
-    exit(1);
+    send_game_state(room, i);
+    LOG_DEBUG("Sent game state to player %d in room %d\n", i, room->room_id);
   }
 
-  for (int i = 0; i < MAX_PLAYERS + PLAYER_PIPES_START; i++)
+  for (int i = 0; i < room->spectators_count; i++)
   {
-    pipe(server->pipe_fds[i]);
+    send_spectator_state(room, room->spectators[i]);
   }
 
-  if (pthread_mutex_init(&server->mutex, NULL) != 0)
+  if (room->tick_rate > 0)
   {
-    perror("mutex init failed");
-    exit(1);
+    start_room_ticker(room);
   }
 }
 
-void run_server(server_t *server)
+/*
+ * Arms a periodic timer for the room and polls it on the worker that
+ * formed the room. The ticker keeps the room alive until that worker tears
+ * it down.
+ */
+void start_room_ticker(room_t *room)
 {
-  int opt = 1;
+  long period = 1000000000L / room->tick_rate;
+  struct itimerspec timer;
+  struct epoll_event event;
 
-  if ((server->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+  if ((room->ticker.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
   {
-    perror("socket failed");
+    perror("timerfd_create failed");
     exit(1);
   }
 
-  if ((server->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+  timer.it_interval.tv_sec = period / 1000000000L;
+  timer.it_interval.tv_nsec = period % 1000000000L;
+  timer.it_value = timer.it_interval;
+  if (timerfd_settime(room->ticker.timer_fd, 0, &timer, NULL) < 0)
   {
-    perror("socket failed");
+    perror("timerfd_settime failed");
     exit(1);
   }
 
-  if (setsockopt(server->sockfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+  retain_room(room);
+  room->ticker.epoll_fd = room->worker->epoll_fd;
+  event.events = EPOLLIN;
+  event.data.ptr = &room->ticker;
+  if (epoll_ctl(room->ticker.epoll_fd, EPOLL_CTL_ADD, room->ticker.timer_fd, &event) < 0)
   {
-    perror("setsockopt failed");
+    perror("epoll_ctl failed");
     exit(1);
   }
+}
 
-  server->address.sin_family = AF_INET;
-  server->address.sin_addr.s_addr = INADDR_ANY;
-  server->address.sin_port = htons(PORT);
+void stop_room_ticker(room_t *room)
+{
+  if (room->ticker.timer_fd >= 0)
+  {
+    __atomic_store_n(&room->ticker.is_stopped, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static message_buffer_t *room_state_message(room_t *room, connection_t *connection)
+{
+  return connection->protocol_version == PROTOCOL_VERSION_FRAMED ? get_room_state_frame(room) : &room->state_message;
+}
+
+void send_communication_metadata(connection_t *connection)
+{
+  char metadata[2];
+  metadata[0] = sizeof(int);
+
+  int big_endian = 1;
+  metadata[1] = *(char *)&big_endian == 1;
+
+  connection_send(connection, metadata, sizeof(metadata));
+}
 
-  if (bind(server->sockfd, (struct sockaddr *)&server->address, sizeof(server->address)) < 0)
+void send_game_metadata(room_t *room, int player_id)
+{
+  connection_t *connection = room->player_list[player_id].connection;
+  if (connection == NULL)
   {
-    perror("bind failed");
-    exit(1);
+    return;
   }
 
-  if (listen(server->sockfd, 4) < 0)
+  if (connection->protocol_version == PROTOCOL_VERSION_FRAMED)
   {
-    perror("listen failed");
-    exit(1);
+    char frame[FRAME_HEADER_SIZE + 2];
+    int length = write_frame_header(frame, SEND_GAME_METADATA, 2);
+    frame[length++] = room->deck->symbols_per_card;
+    frame[length++] = player_id;
+    connection_send(connection, frame, length);
+    return;
   }
 
-  wait_for_players(server);
+  int metadata[] = {SEND_GAME_METADATA, room->deck->symbols_per_card, player_id, END_REQUEST};
+  connection_send(connection, metadata, sizeof(metadata));
+}
+
+void send_spectator_metadata(room_t *room, connection_t *connection)
+{
+  char frame[FRAME_HEADER_SIZE + 2];
+  int length = write_frame_header(frame, SEND_GAME_METADATA, 2);
+  frame[length++] = room->deck->symbols_per_card;
+  frame[length++] = SPECTATOR_PLAYER_ID;
+
+  shared_message_t *message = create_shared_message(frame, length);
+  connection_send_shared(connection, &message, 1, 0);
+  release_shared_message(message);
+}
+
+static shared_message_t *create_finish_message(void)
+{
+  char frame[FRAME_HEADER_SIZE];
+  return create_shared_message(frame, write_frame_header(frame, FINISH_GAME, 0));
+}
+
+/*
+ * A game is over for its spectators once it finished or every player left.
+ */
+static int is_game_over(room_t *room)
+{
+  return room->game.has_finished || room_connections_count(room) == 0;
 }
 
-void wait_for_players(server_t *server)
+/*
+ * Queues the full state for one spectator, followed by the finish
+ * notification once the game is over.
+ */
+void send_spectator_state(room_t *room, connection_t *connection)
 {
-  game_t game;
-  printf("Server is listening for players on port %d\n", PORT);
-  while (server->num_players < MAX_PLAYERS)
+  if (!room->has_started)
   {
-    int new_socket;
-    int addrlen = sizeof(server->address);
+    return;
+  }
 
-    if ((new_socket = accept(server->sockfd, (struct sockaddr *)&server->address, (socklen_t *)&addrlen)) < 0)
-    {
-      perror("accept failed");
-      exit(1);
-    }
+  message_buffer_t *frame = get_room_state_frame(room);
+  shared_message_t *state = create_shared_message(frame->data, frame->length);
+  connection_send_shared(connection, &state, 1, 1);
+  release_shared_message(state);
+
+  if (is_game_over(room))
+  {
+    shared_message_t *finish = create_finish_message();
+    connection_send_shared(connection, &finish, 1, 0);
+    release_shared_message(finish);
+  }
+}
+
+/*
+ * Tells the spectators that no more states will come, once the game has
+ * finished or every player left. It is queued apart from the states, so
+ * dropping an unsent state never drops it.
+ */
+void send_spectators_finish(room_t *room)
+{
+  shared_message_t *finish = create_finish_message();
+
+  for (int i = 0; i < room->spectators_count; i++)
+  {
+    connection_send_shared(room->spectators[i], &finish, 1, 0);
+  }
+  release_shared_message(finish);
+}
 
-    server->player_list[server->num_players].sockfd = new_socket;
-    server->player_list[server->num_players].player_id = server->num_players;
+void send_game_state(room_t *room, int player_id)
+{
+  connection_t *connection = room->player_list[player_id].connection;
+  if (connection == NULL)
+  {
+    return;
+  }
 
-    player_thread_args_t *args = (player_thread_args_t *)malloc(sizeof(player_thread_args_t));
+  message_buffer_t *message = room_state_message(room, connection);
+  struct iovec iov;
+  iov.iov_base = message->data;
+  iov.iov_len = message->length;
+  connection_send_state(connection, &iov, 1, 0);
+}
 
-    if (args == NULL)
+void send_finish_game(room_t *room)
+{
+  for (int i = 0; i < room->game.players_count; i++)
+  {
+    connection_t *connection = room->player_list[i].connection;
+    if (connection == NULL)
     {
-      perror("player thread args malloc failed");
-      exit(1);
+      continue;
     }
 
-    args->server = server;
-    args->player = &server->player_list[server->num_players];
-    args->game = &game;
-
-    if (pthread_create(&server->player_threads[server->num_players], NULL, player_thread, (void *)args) != 0)
+    if (connection->protocol_version == PROTOCOL_VERSION_FRAMED)
     {
-      perror("pthread_create failed");
-      exit(1);
+      char frame[FRAME_HEADER_SIZE];
+      connection_send(connection, frame, write_frame_header(frame, FINISH_GAME, 0));
+    }
+    else
+    {
+      request_type_t request = FINISH_GAME;
+      connection_send(connection, &request, sizeof(request));
     }
+    LOG_DEBUG("Sent finish game request to player %d in room %d\n", i, room->room_id);
+  }
+}
 
-    server->num_players++;
+static uint64_t first_trace_id(const room_action_t *actions, int actions_count)
+{
+  for (int i = 0; i < actions_count; i++)
+  {
+    if (actions[i].trace_id != 0)
+    {
+      return actions[i].trace_id;
+    }
   }
 
-  char name_buffer[MAX_PLAYER_NAME_LENGTH];
+  return 0;
+}
+
+/*
+ * Appends the return code of every given action made by the player, in
+ * the protocol its connection negotiated. Returns the number of bytes.
+ */
+static int encode_return_codes(char *buffer, int is_framed, int player_id, const room_action_t *actions, int actions_count)
+{
+  int length = 0;
 
-  for (int i = 0; i < MAX_PLAYERS; i++)
+  for (int i = 0; i < actions_count; i++)
   {
-    int player_id = server->player_list[i].player_id;
-    if (read(server->pipe_fds[PLAYER_PIPES_START + player_id][PIPE_READ], name_buffer, MAX_PLAYER_NAME_LENGTH) < 0)
+    if (actions[i].player_id != player_id)
     {
-      perror("read failed");
-      exit(1);
+      continue;
+    }
+
+    if (is_framed)
+    {
+      length += write_frame_header(buffer + length, SEND_RETURN_CODE, 1);
+      buffer[length++] = actions[i].return_code;
+    }
+    else
+    {
+      int return_code_message[] = {SEND_RETURN_CODE, actions[i].return_code};
+      memcpy(buffer + length, return_code_message, sizeof(return_code_message));
+      length += sizeof(return_code_message);
     }
   }
 
-  int player_ids[MAX_PLAYERS];
-  for (int i = 0; i < MAX_PLAYERS; i++)
+  return length;
+}
+
+/*
+ * Every spectator gets the same delta, copied once into a shared message
+ * their queues point to, so a spectator costs one gathered write and no
+ * copy. One whose previous state is still queued gets the shared snapshot
+ * instead.
+ */
+static void broadcast_to_spectators(room_t *room, int has_changed)
+{
+  shared_message_t *snapshot = NULL;
+
+  if (room->spectators_count == 0 || !has_changed)
   {
-    player_ids[i] = i;
+    return;
   }
-  init_game(&game, player_ids, MAX_PLAYERS);
 
-  int opt = 1;
-  for (int i = 0; i < MAX_PLAYERS; i++)
+  shared_message_t *delta = create_shared_message(room->delta_frame.data, room->delta_frame.length);
+  for (int i = 0; i < room->spectators_count; i++)
   {
-    if (write(server->pipe_fds[START_GAME_PIPE][PIPE_WRITE], &opt, sizeof(opt)) < 0)
+    connection_t *connection = room->spectators[i];
+    shared_message_t *message = delta;
+
+    if (connection_has_queued_state(connection))
     {
-      perror("write failed");
-      exit(1);
+      if (snapshot == NULL)
+      {
+        message_buffer_t *frame = get_room_state_frame(room);
+        snapshot = create_shared_message(frame->data, frame->length);
+      }
+      message = snapshot;
     }
+    connection_send_shared(connection, &message, 1, 1);
   }
-  printf("Sent start signal to player threads\n");
 
-  for (int i = 0; i < MAX_PLAYERS; i++)
+  release_shared_message(delta);
+  if (snapshot != NULL)
+  {
+    release_shared_message(snapshot);
+  }
+  if (room->game.has_finished)
   {
-    pthread_join(server->player_threads[i], NULL);
+    send_spectators_finish(room);
   }
 }
 
-void send_communication_metadata(server_t *server, int player_id)
+/*
+ * Pushes the already encoded state to every player with one send each. The
+ * return codes of the player's own actions and the finish notification
+ * ride along in the same gathered write, in the protocol each connection
+ * negotiated. Legacy players always get the whole state, framed players
+ * only the delta and nothing at all when the state did not change. A state
+ * a slow reader has not received yet is replaced by the new one, and for
+ * framed players by a full snapshot, since the dropped delta is missing.
+ */
+void broadcast_game_state(room_t *room, const room_action_t *actions, int actions_count, int has_changed)
 {
-  int player_sockfd = server->player_list[player_id].sockfd;
-  int int_size = sizeof(int);
-  send(player_sockfd, &int_size, 1, 0);
+  request_type_t finish_request = FINISH_GAME;
+  char return_codes[MAX_TICK_ACTIONS * 2 * sizeof(int)];
+  char finish_frame[FRAME_HEADER_SIZE];
+  uint64_t started_at = stats_now_ns();
+  uint64_t trace_id = first_trace_id(actions, actions_count);
 
-  int big_endian = 1;
-  int is_little_endian = *(char *)&big_endian == 1;
-  send(player_sockfd, &is_little_endian, 1, 0);
-}
+  write_frame_header(finish_frame, FINISH_GAME, 0);
 
-void send_game_metadata(server_t *server, int player_id)
-{
-  int player_sockfd = server->player_list[player_id].sockfd;
-  request_type_t request = SEND_GAME_METADATA;
-  send(player_sockfd, &request, sizeof(request), 0);
-  int symbols_per_card = SYMBOLS_PER_CARD;
-  send(player_sockfd, &symbols_per_card, sizeof(symbols_per_card), 0);
-  send(player_sockfd, &player_id, sizeof(player_id), 0);
-  request = END_REQUEST;
-  send(player_sockfd, &request, sizeof(request), 0);
+  for (int i = 0; i < room->game.players_count; i++)
+  {
+    connection_t *connection = room->player_list[i].connection;
+    struct iovec iov[3];
+    int iov_count = 0;
+    int state_index = -1;
+
+    if (connection == NULL)
+    {
+      continue;
+    }
+
+    int is_framed = connection->protocol_version == PROTOCOL_VERSION_FRAMED;
+    message_buffer_t *message = is_framed ? &room->delta_frame : &room->state_message;
+    if (is_framed && has_changed && connection_has_queued_state(connection))
+    {
+      message = get_room_state_frame(room);
+    }
+    int return_codes_length = encode_return_codes(return_codes, is_framed, i, actions, actions_count);
+
+    if (return_codes_length > 0)
+    {
+      iov[iov_count].iov_base = return_codes;
+      iov[iov_count].iov_len = return_codes_length;
+      iov_count++;
+    }
+    if (!is_framed || has_changed)
+    {
+      state_index = iov_count;
+      iov[iov_count].iov_base = message->data;
+      iov[iov_count].iov_len = message->length;
+      iov_count++;
+    }
+    if (room->game.has_finished)
+    {
+      iov[iov_count].iov_base = is_framed ? (void *)finish_frame : (void *)&finish_request;
+      iov[iov_count].iov_len = is_framed ? sizeof(finish_frame) : sizeof(finish_request);
+      iov_count++;
+    }
+
+    if (iov_count > 0)
+    {
+      uint64_t send_started_at = TRACE_CLOCK(trace_id);
+      connection_send_state(connection, iov, iov_count, state_index);
+      TRACE_SPAN(trace_id, TRACE_SEND, send_started_at, room->room_id, i);
+    }
+  }
+  broadcast_to_spectators(room, has_changed);
+
+  uint64_t duration = stats_now_ns() - started_at;
+  record_thread_duration(BROADCAST_DURATION, duration);
+  record_histogram(&room->stats.broadcast_duration, duration);
 }
 
-void send_game_state(server_t *server, game_t* game, int player_id) 
+/*
+ * Applies one action to the game and commits the state version it leads
+ * to, so the next action in the same tick is checked against it.
+ */
+void apply_game_action(room_t *room, room_action_t *room_action)
 {
-  int player_sockfd = server->player_list[player_id].sockfd, temp;
-  
-  request_type_t request = SEND_GAME_STATE;
-  send(player_sockfd, &request, sizeof(request), 0);
-  
-  temp = SYMBOLS_PER_CARD;
-  send(player_sockfd, &temp, sizeof(temp), 0);
-  for (int i = 0; i < SYMBOLS_PER_CARD; i++) {
-    temp = game->current_top_card[i];
-    send(player_sockfd, &temp, sizeof(temp), 0);
+  int player_id = room_action->player_id;
+  action_t *action = &room_action->action;
+
+  LOG_DEBUG("Received action type %d from player %d\n", action->action_type, player_id);
+  uint64_t validate_started_at = TRACE_CLOCK(room_action->trace_id);
+  int is_current = is_action_current(room, player_id, action);
+  TRACE_SPAN(room_action->trace_id, TRACE_VALIDATE, validate_started_at, room->room_id, player_id);
+  if (!is_current)
+  {
+    room_action->return_code = INCORRECT_BOARD_HASH;
+  }
+  else
+  {
+    uint64_t act_started_at = stats_now_ns();
+    room_action->return_code = act_player(&room->game, action, player_id);
+    record_thread_duration(ACT_PLAYER_DURATION, stats_now_ns() - act_started_at);
+    TRACE_SPAN(room_action->trace_id, TRACE_ACT_PLAYER, act_started_at, room->room_id, player_id);
   }
-  
-  send(player_sockfd, &game->players_count, sizeof(game->players_count), 0);
-  for(int i = 0; i < game->players_count; i++) {
-    player_state_t player = game->player_states[i];
-    player_t player_info = server->player_list[i];
-    send(player_sockfd, &player.player_id, sizeof(player.player_id), 0);
-    send(player_sockfd, &player_info.name, MAX_PLAYER_NAME_LENGTH, 0);
-    send(player_sockfd, &player.current_card, SYMBOLS_PER_CARD * sizeof(int), 0);
-    send(player_sockfd, &player.cards_in_hand_count, sizeof(player.cards_in_hand_count), 0);
-    send(player_sockfd, &player.swaps_left, sizeof(player.swaps_left), 0);
-    send(player_sockfd, &player.swaps_cooldown, sizeof(player.swaps_cooldown), 0);
-    send(player_sockfd, &player.freezes_left, sizeof(player.freezes_left), 0);
-    send(player_sockfd, &player.freezes_cooldown, sizeof(player.freezes_cooldown), 0);
-    send(player_sockfd, &player.rerolls_left, sizeof(player.rerolls_left), 0);
-    send(player_sockfd, &player.rerolls_cooldown, sizeof(player.rerolls_cooldown), 0);
-    send(player_sockfd, &player.is_frozen_count, sizeof(player.is_frozen_count), 0);
+  room->actions_count++;
+  commit_room_state(room);
+  if (is_current)
+  {
+    journal_room_action(room, room_action);
   }
 
-  request = END_REQUEST;
-  send(player_sockfd, &request, sizeof(request), 0);
+  uint64_t latency = stats_now_ns() - room_action->arrived_at;
+  record_thread_duration(ACTION_LATENCY, latency);
+  record_thread_return_code(room_action->return_code);
+  record_histogram(&room->stats.action_latency, latency);
+  increment_stats_counter(&room->stats.actions_count, 1);
+  increment_stats_counter(&room->stats.return_codes[room_action->return_code], 1);
+  LOG_DEBUG("Finished processing action type %d from player %d\n", action->action_type, player_id);
 }
 
-void send_finish_game(server_t *server)
+/*
+ * Publishes the state the actions led to and records the encoding as a
+ * span of the first traced action among them.
+ */
+static int publish_traced_room_state(room_t *room, const room_action_t *actions, int actions_count)
 {
-  for (int i = 0; i < server->num_players; i++)
-  {
-    request_type_t request = FINISH_GAME;
-    send(server->player_list[i].sockfd, &request, sizeof(request), 0);
-    printf("Sent finish game request to player %d\n", i);
-  }
+  uint64_t trace_id = first_trace_id(actions, actions_count);
+  uint64_t started_at = TRACE_CLOCK(trace_id);
+  int has_changed = publish_room_state(room);
+
+  TRACE_SPAN(trace_id, TRACE_SERIALIZE, started_at, room->room_id, -1);
+  return has_changed;
 }
 
-void receive_game_action(server_t *server, game_t *game, int player_id)
+/*
+ * Answers an action that never reached the game to its player alone. The
+ * state did not change, so nobody else hears about it.
+ */
+static void reject_game_action(room_t *room, room_action_t *room_action)
 {
-  pthread_mutex_lock(&server->mutex);
-  
-  if (game->has_finished)
+  char return_code[2 * sizeof(int)];
+  connection_t *connection = room->player_list[room_action->player_id].connection;
+
+  LOG_DEBUG("Rejected action type %d from player %d, the tick is full\n", room_action->action.action_type,
+            room_action->player_id);
+  room_action->return_code = ERROR;
+  if (connection == NULL)
   {
-    printf("Game has finished\n");
-    pthread_mutex_unlock(&server->mutex);
     return;
   }
 
-  int player_sockfd = server->player_list[player_id].sockfd;
-  action_t action;
-  recv(player_sockfd, &action.action_type, sizeof(int), 0);
-  recv(player_sockfd, &action.id, sizeof(int), 0);
-  recv(player_sockfd, &action.board_hash, sizeof(int), 0);
+  int is_framed = connection->protocol_version == PROTOCOL_VERSION_FRAMED;
+  connection_send(connection, return_code,
+                  encode_return_codes(return_code, is_framed, room_action->player_id, room_action, 1));
+}
+
+void receive_game_action(room_t *room, room_action_t *room_action)
+{
+  game_t *game = &room->game;
 
-  printf("Received action type %d from player %d\n", action.action_type, player_id);
-  return_code_t return_code_value;
-  if(action.board_hash != calculate_board_hash(game))
+  if (!room->has_started || game->has_finished)
   {
-    return_code_value = INCORRECT_BOARD_HASH;
+    LOG_DEBUG("Game in room %d is not running\n", room->room_id);
+    return;
   }
-  else
+
+  if (room->tick_rate > 0)
   {
-    return_code_value = act_player(game, &action, player_id);
+    if (!add_tick_action(room, room_action))
+    {
+      reject_game_action(room, room_action);
+    }
+    return;
   }
-  printf("Finished processing action type %d from player %d\n", action.action_type, player_id);
-  
-  request_type_t end_request;
-  recv(player_sockfd, &end_request, sizeof(int), 0);
-  if (end_request != END_REQUEST)
+
+  apply_game_action(room, room_action);
+  int has_changed = publish_traced_room_state(room, room_action, 1);
+  broadcast_game_state(room, room_action, 1, has_changed);
+
+  if (game->has_finished)
   {
-    perror("Invalid end request");
-    exit(1);
+    close_room_journal(room);
+    LOG_INFO("The game in room %d has finished\n", room->room_id);
   }
-  printf("Received end request from player %d\n", player_id);
+}
 
-  request_type_t request = SEND_RETURN_CODE;
-  send(player_sockfd, &request, sizeof(request), 0);
-  send(player_sockfd, &return_code_value, sizeof(int), 0); 
+/*
+ * Resolves the actions collected since the last tick in the order they
+ * arrived at the server, so of two guesses on the same top card the
+ * earlier one wins and the later one no longer matches its state version.
+ * Actions behind the one that finishes the game never reach it and are
+ * answered with ERROR. Everything that happened goes out as a single
+ * broadcast.
+ */
+void run_room_tick(room_t *room)
+{
+  game_t *game = &room->game;
+  int actions_count = take_tick_actions(room);
 
-  for (int i=0; i < server->num_players; i++)
+  if (actions_count == 0 || game->has_finished)
   {
-    printf("Sending game state to player %d\n", i);
-    send_game_state(server, game, i);
-    printf("Sent game state to player %d\n", i);
+    return;
   }
 
-  if (game->has_finished)
+  for (int i = 0; i < actions_count; i++)
   {
-    printf("The game has finished\n");
-    send_finish_game(server);
+    if (game->has_finished)
+    {
+      room->tick_actions[i].return_code = ERROR;
+      continue;
+    }
+    apply_game_action(room, &room->tick_actions[i]);
   }
 
-  pthread_mutex_unlock(&server->mutex);
-}
+  int has_changed = publish_traced_room_state(room, room->tick_actions, actions_count);
+  broadcast_game_state(room, room->tick_actions, actions_count, has_changed);
 
+  if (game->has_finished)
+  {
+    stop_room_ticker(room);
+    close_room_journal(room);
+    LOG_INFO("The game in room %d has finished\n", room->room_id);
+  }
+}
 
 void destroy_server(server_t *server)
 {
-  close(server->sockfd);
-  free(server->player_list);
-  free(server->player_threads);
+  for (int i = 0; i < server->workers_count; i++)
+  {
+    close(server->workers[i].listen_fd);
+    close(server->workers[i].epoll_fd);
+    pthread_mutex_destroy(&server->workers[i].handed_over_mutex);
+  }
+  free(server->workers);
+  destroy_room_manager(&server->room_manager);
+  destroy_decks();
+  stop_journal();
+  stop_tracing();
+  stop_logger();
 }
@@ -1,70 +1,158 @@
+#ifndef SERVER_H
+#define SERVER_H
+
 #include <netinet/in.h>
 #include <unistd.h>
 #include <asm-generic/socket.h>
 #include <pthread.h>
-#include "game.h"
+#include "connection.h"
+#include "lobby.h"
+#include "protocol.h"
+#include "room.h"
+#include "trace.h"
 
-#define MAX_PLAYER_NAME_LENGTH 32
-#define MAX_PLAYERS 3
 #define PORT 8080
-#define START_GAME_PIPE 0
-#define PLAYER_PIPES_START 1
-#define PIPE_WRITE 1
-#define PIPE_READ 0
-
+#define MAX_EPOLL_EVENTS 64
+#define MAX_TICK_RATE 1000
+#define WORKER_STATS_INTERVAL_SECONDS 10
+#define STATS_SNAPSHOT_INTERVAL_SECONDS 1
+
+struct server;
+
+/*
+ * With a tick rate, rooms collect actions and resolve them in arrival
+ * order once per tick, sending one broadcast per tick instead of one per
+ * action. A room starts as soon as players_per_room players are waiting.
+ * With a stats path, a JSON snapshot of the latency histograms and
+ * counters is rewritten there every STATS_SNAPSHOT_INTERVAL_SECONDS.
+ * With a trace path, one in every trace_sample_interval actions is traced
+ * stage by stage into a Chrome trace file. With a journal path, every
+ * game is journaled there so that dobble_replay can play it again. With a
+ * handoff path, a server started later with the same path takes over the
+ * running games and their sockets from this one.
+ */
 typedef struct
 {
-  int player_id;
-  char name[MAX_PLAYER_NAME_LENGTH];
-  int sockfd;
-} player_t;
-
-typedef struct
+  int symbols_per_card;
+  int tick_rate;
+  int players_per_room;
+  const char *stats_path;
+  const char *trace_path;
+  int trace_sample_interval;
+  const char *journal_path;
+  const char *handoff_path;
+} server_config_t;
+
+/*
+ * A worker owns a listener, the connections it accepted, its lobby and
+ * the rooms it formed from them, so a room only ever runs on its worker.
+ * Spectators of a room on another worker are handed over to it through
+ * the handed over list, the only part other threads touch. Its counters
+ * are read by the stats reporter.
+ */
+typedef struct worker
+{
+  poll_source_type_t source_type;
+  int worker_id;
+  int epoll_fd;
+  int listen_fd;
+  connection_t *handshaking;
+  lobby_t lobby;
+  pthread_mutex_t handed_over_mutex;
+  connection_t *handed_over;
+  pthread_t thread;
+  struct server *server;
+  long long accepted_count;
+  int rooms_count;
+  long long started_rooms_count;
+} worker_t;
+
+typedef struct server
 {
-  player_t *player_list;
-  int num_players;
-  int sockfd;
   struct sockaddr_in address;
-  pthread_t *player_threads;
-  int pipe_fds[PLAYER_PIPES_START + MAX_PLAYERS][2];
-  pthread_mutex_t mutex;
+  server_config_t config;
+  room_manager_t room_manager;
+  worker_t *workers;
+  int workers_count;
+  poll_source_type_t handoff_source;
+  int handoff_fd;
+  int handoff_listen_fd;
+  pthread_barrier_t handoff_barrier;
+  pthread_t handoff_thread;
 } server_t;
 
-typedef struct
-{
-  server_t *server;
-  player_t *player;
-  game_t *game;
-} player_thread_args_t;
+void init_server(server_t *server, const server_config_t *config);
 
-typedef enum request_type
-{
-  SEND_GAME_STATE,
-  END_REQUEST,
-  SEND_GAME_METADATA,
-  MAKE_ACTION,
-  FINISH_GAME,
-  SEND_RETURN_CODE
-} request_type_t;
+void run_server(server_t *server);
 
-void init_server_player(player_thread_args_t *arg);
+void *worker_thread(void *arg);
 
-void *player_thread(void *arg);
+void register_listener(worker_t *worker);
 
-void init_server(server_t *server);
+void accept_connections(worker_t *worker);
 
-void run_server(server_t *server);
+void register_connection(connection_t *connection);
+
+void add_handshaking_connection(worker_t *worker, connection_t *connection);
+
+void add_handed_over_connection(worker_t *worker, connection_t *connection);
+
+void report_worker_stats(server_t *server);
+
+void flush_room_journals(server_t *server);
+
+void handle_connection_input(server_t *server, connection_t *connection);
+
+void adopt_connection(server_t *server, connection_t *connection);
+
+void handle_player_name(server_t *server, connection_t *connection, const char *name, int length);
+
+void handle_spectator(server_t *server, connection_t *connection, room_t *room, int room_id);
 
-void wait_for_players(server_t *server);
+void handle_request(server_t *server, connection_t *connection, request_t *request, uint64_t trace_id);
 
-void send_communication_metadata(server_t *server, int player_id);
+void close_connection(server_t *server, connection_t *connection);
 
-void send_game_metadata(server_t *server, int player_id); 
+void handle_room_ticker(server_t *server, room_ticker_t *ticker);
 
-void send_game_state(server_t *server, game_t* game, int player_id);
+void dispatch_room_event(server_t *server, room_t *room, room_event_t *event);
 
-void send_finish_game(server_t *server);
+void run_room_events(server_t *server, room_t *room);
 
-void receive_game_action(server_t *server, game_t *game, int player_id);
+void process_room_event(room_t *room, room_event_t *event);
+
+int room_connections_count(room_t *room);
+
+void start_room_game(room_t *room);
+
+void start_room_ticker(room_t *room);
+
+void stop_room_ticker(room_t *room);
+
+void close_room_journal(room_t *room);
+
+void send_communication_metadata(connection_t *connection);
+
+void send_game_metadata(room_t *room, int player_id);
+
+void send_game_state(room_t *room, int player_id);
+
+void send_spectator_metadata(room_t *room, connection_t *connection);
+
+void send_spectator_state(room_t *room, connection_t *connection);
+
+void send_spectators_finish(room_t *room);
+
+void send_finish_game(room_t *room);
+
+void broadcast_game_state(room_t *room, const room_action_t *actions, int actions_count, int has_changed);
+
+void apply_game_action(room_t *room, room_action_t *room_action);
+
+void receive_game_action(room_t *room, room_action_t *room_action);
+
+void run_room_tick(room_t *room);
 
 void destroy_server(server_t *server);
+
+#endif
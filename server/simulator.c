@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "game.h"
+
+#define DEFAULT_SIMULATED_GAMES 100000
+#define MAX_ACTIONS_PER_GAME 100000
+
+/*
+ * Bot policy: every action is a wrong guess with probability mistake_rate,
+ * an ability with probability ability_rate, and the matching symbol
+ * otherwise.
+ */
+typedef struct
+{
+  int games_count;
+  int threads_count;
+  int players_count;
+  int symbols_per_card;
+  double mistake_rate;
+  double ability_rate;
+  uint64_t seed;
+} simulator_config_t;
+
+typedef struct
+{
+  const simulator_config_t *config;
+  const deck_t *deck;
+  int first_game;
+  int games_count;
+  pthread_t thread;
+  long long actions_count;
+  long long stalled_games_count;
+  long long return_codes[RETURN_CODES_COUNT];
+} simulator_shard_t;
+
+static void print_usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [-g games] [-t threads] [-p players] [-s symbols_per_card] "
+          "[-m mistake_rate] [-a ability_rate] [-r seed]\n",
+          program);
+  exit(1);
+}
+
+static void parse_simulator_config(int argc, char **argv, simulator_config_t *config)
+{
+  int option;
+
+  config->games_count = DEFAULT_SIMULATED_GAMES;
+  config->threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+  config->players_count = 3;
+  config->symbols_per_card = DEFAULT_SYMBOLS_PER_CARD;
+  config->mistake_rate = 0.1;
+  config->ability_rate = 0.05;
+  config->seed = 1;
+
+  while ((option = getopt(argc, argv, "g:t:p:s:m:a:r:")) != -1)
+  {
+    switch (option)
+    {
+    case 'g':
+      config->games_count = atoi(optarg);
+      break;
+    case 't':
+      config->threads_count = atoi(optarg);
+      break;
+    case 'p':
+      config->players_count = atoi(optarg);
+      break;
+    case 's':
+      config->symbols_per_card = atoi(optarg);
+      break;
+    case 'm':
+      config->mistake_rate = atof(optarg);
+      break;
+    case 'a':
+      config->ability_rate = atof(optarg);
+      break;
+    case 'r':
+      config->seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      print_usage(argv[0]);
+    }
+  }
+
+  if (config->threads_count < 1)
+  {
+    config->threads_count = 1;
+  }
+  if (config->players_count < 2 || config->players_count > MAX_GAME_PLAYERS)
+  {
+    fprintf(stderr, "Players count must be between 2 and %d\n", MAX_GAME_PLAYERS);
+    exit(1);
+  }
+}
+
+static double random_unit(rng_t *rng)
+{
+  return (next_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void choose_bot_action(const simulator_config_t *config, game_t *game, rng_t *rng, int player_id, action_t *action)
+{
+  player_state_t *player_state = &game->player_states[player_id];
+  double roll = random_unit(rng);
+
+  if (roll < config->ability_rate)
+  {
+    int target_id = random_below(rng, game->players_count - 1);
+
+    action->action_type = SWAP + random_below(rng, 3);
+    action->id = target_id >= player_id ? target_id + 1 : target_id;
+  }
+  else
+  {
+    int symbol = common_symbol(game->deck, player_state->current_card_index, game->current_top_card_index);
+
+    if (roll < config->ability_rate + config->mistake_rate)
+    {
+      const int *symbols = get_card_symbols(game->deck, player_state->current_card_index);
+      int position = random_below(rng, game->deck->symbols_per_card);
+      if (symbols[position] == symbol)
+      {
+        position = (position + 1) % game->deck->symbols_per_card;
+      }
+      symbol = symbols[position];
+    }
+
+    action->action_type = CARD;
+    action->id = symbol;
+  }
+
+  action->board_hash = get_board_hash(game);
+}
+
+/*
+ * Plays the shard's games one after another in the same game_t, so after
+ * the first deal no memory is touched but the game state itself. Counters
+ * stay on the stack until the end to keep shards off each other's lines.
+ */
+static void *run_simulator_shard(void *arg)
+{
+  simulator_shard_t *shard = (simulator_shard_t *)arg;
+  const simulator_config_t *config = shard->config;
+  game_t game;
+  deal_t deal;
+  rng_t rng;
+  long long actions_count = 0;
+  long long stalled_games_count = 0;
+  long long return_codes[RETURN_CODES_COUNT] = {0};
+
+  for (int i = 0; i < shard->games_count; i++)
+  {
+    uint64_t seed_state = config->seed + shard->first_game + i;
+    uint64_t seed = splitmix64(&seed_state);
+    int game_actions_count = 0;
+
+    seed_rng(&rng, seed ^ 0x9e3779b97f4a7c15ULL);
+    deal_cards(&deal, shard->deck, seed);
+    init_game(&game, shard->deck, &deal, config->players_count);
+
+    while (!game.has_finished && game_actions_count < MAX_ACTIONS_PER_GAME)
+    {
+      action_t action;
+      int player_id = random_below(&rng, game.players_count);
+
+      choose_bot_action(config, &game, &rng, player_id, &action);
+      return_codes[act_player(&game, &action, player_id)]++;
+      game_actions_count++;
+    }
+
+    if (!game.has_finished)
+    {
+      stalled_games_count++;
+    }
+    actions_count += game_actions_count;
+    destroy_game(&game);
+  }
+
+  shard->actions_count = actions_count;
+  shard->stalled_games_count = stalled_games_count;
+  memcpy(shard->return_codes, return_codes, sizeof(return_codes));
+
+  return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  simulator_config_t config;
+  struct timespec start, end;
+  long long actions_count = 0;
+  long long stalled_games_count = 0;
+  long long return_codes[RETURN_CODES_COUNT] = {0};
+
+  parse_simulator_config(argc, argv, &config);
+
+  const deck_t *deck = get_deck(config.symbols_per_card);
+  if (deck == NULL)
+  {
+    fprintf(stderr, "No deck with %d symbols per card\n", config.symbols_per_card);
+    exit(1);
+  }
+
+  simulator_shard_t *shards = (simulator_shard_t *)calloc(config.threads_count, sizeof(simulator_shard_t));
+  if (shards == NULL)
+  {
+    perror("shards calloc failed");
+    exit(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0, first_game = 0; i < config.threads_count; i++)
+  {
+    simulator_shard_t *shard = &shards[i];
+    shard->config = &config;
+    shard->deck = deck;
+    shard->first_game = first_game;
+    shard->games_count = config.games_count / config.threads_count + (i < config.games_count % config.threads_count);
+    first_game += shard->games_count;
+
+    if (pthread_create(&shard->thread, NULL, run_simulator_shard, shard) != 0)
+    {
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < config.threads_count; i++)
+  {
+    pthread_join(shards[i].thread, NULL);
+    actions_count += shards[i].actions_count;
+    stalled_games_count += shards[i].stalled_games_count;
+    for (int j = 0; j < RETURN_CODES_COUNT; j++)
+    {
+      return_codes[j] += shards[i].return_codes[j];
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = elapsed_seconds(&start, &end);
+
+  printf("Simulated %d games of %d players with %d symbols per card on %d threads in %.3f s\n",
+         config.games_count, config.players_count, config.symbols_per_card, config.threads_count, seconds);
+  printf("Games: %.0f games/s, actions: %lld (%.0f actions/s), stalled games: %lld\n",
+         config.games_count / seconds, actions_count, actions_count / seconds, stalled_games_count);
+  printf("Return codes:");
+  for (int i = 0; i < RETURN_CODES_COUNT; i++)
+  {
+    printf(" %d=%lld", i, return_codes[i]);
+  }
+  printf("\n");
+
+  free(shards);
+  destroy_decks();
+
+  return 0;
+}
@@ -0,0 +1,188 @@
+#include "stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+const char *const stats_histogram_names[STATS_HISTOGRAMS_COUNT] = {
+    "action_latency_ns",
+    "act_player_ns",
+    "broadcast_ns",
+    "room_queue_wait_ns",
+};
+
+static __thread thread_stats_t *current_thread_stats;
+static thread_stats_t *all_thread_stats;
+static pthread_mutex_t thread_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stats_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_BUCKETS)
+  {
+    return value;
+  }
+
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent > HISTOGRAM_MAX_EXPONENT)
+  {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+
+  int sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/*
+ * Highest value that falls into the bucket.
+ */
+static uint64_t histogram_bucket_value(int bucket)
+{
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+  {
+    return bucket;
+  }
+
+  int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void increment_stats_counter(uint64_t *counter, uint64_t value)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Only ever called by the single thread writing the histogram.
+ */
+void record_histogram(histogram_t *histogram, uint64_t value)
+{
+  uint32_t *count = &histogram->counts[histogram_bucket(value)];
+
+  __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+  increment_stats_counter(&histogram->total_count, 1);
+  if (value > __atomic_load_n(&histogram->max_value, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(&histogram->max_value, value, __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile)
+{
+  uint64_t total_count = 0;
+  uint64_t max_value = __atomic_load_n(&histogram->max_value, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    total_count += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+  }
+  if (total_count == 0)
+  {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(percentile * total_count);
+  uint64_t seen = 0;
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+    if (seen >= rank)
+    {
+      uint64_t value = histogram_bucket_value(i);
+      return value < max_value ? value : max_value;
+    }
+  }
+
+  return max_value;
+}
+
+void write_histogram_json(FILE *file, const char *name, const histogram_t *histogram)
+{
+  fprintf(file, "\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}", name,
+          (unsigned long long)__atomic_load_n(&histogram->total_count, __ATOMIC_RELAXED),
+          (unsigned long long)histogram_percentile(histogram, 0.5),
+          (unsigned long long)histogram_percentile(histogram, 0.99),
+          (unsigned long long)histogram_percentile(histogram, 0.999),
+          (unsigned long long)__atomic_load_n(&histogram->max_value, __ATOMIC_RELAXED));
+}
+
+void write_return_codes_json(FILE *file, const uint64_t *return_codes, uint64_t actions_count)
+{
+  fprintf(file, "\"return_codes\":[");
+  for (int i = 0; i < RETURN_CODES_COUNT; i++)
+  {
+    fprintf(file, "%s%llu", i > 0 ? "," : "", (unsigned long long)__atomic_load_n(&return_codes[i], __ATOMIC_RELAXED));
+  }
+  fprintf(file, "],\"incorrect_board_hash_rate\":%.4f",
+          actions_count > 0 ? (double)__atomic_load_n(&return_codes[INCORRECT_BOARD_HASH], __ATOMIC_RELAXED) / actions_count
+                            : 0.0);
+}
+
+/*
+ * Gives the calling worker thread its stats block. Threads that never
+ * register record nothing.
+ */
+void register_thread_stats(int worker_id)
+{
+  thread_stats_t *stats = (thread_stats_t *)calloc(1, sizeof(thread_stats_t));
+
+  if (stats == NULL)
+  {
+    perror("thread stats calloc failed");
+    exit(1);
+  }
+  stats->worker_id = worker_id;
+
+  pthread_mutex_lock(&thread_stats_mutex);
+  stats->next = all_thread_stats;
+  __atomic_store_n(&all_thread_stats, stats, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&thread_stats_mutex);
+
+  current_thread_stats = stats;
+}
+
+thread_stats_t *get_thread_stats(void)
+{
+  return current_thread_stats;
+}
+
+thread_stats_t *get_all_thread_stats(void)
+{
+  return __atomic_load_n(&all_thread_stats, __ATOMIC_ACQUIRE);
+}
+
+void record_thread_duration(stats_histogram_t histogram, uint64_t value)
+{
+  if (current_thread_stats != NULL)
+  {
+    record_histogram(&current_thread_stats->histograms[histogram], value);
+  }
+}
+
+void record_thread_return_code(return_code_t return_code)
+{
+  if (current_thread_stats != NULL)
+  {
+    increment_stats_counter(&current_thread_stats->actions_count, 1);
+    increment_stats_counter(&current_thread_stats->return_codes[return_code], 1);
+  }
+}
+
+void record_thread_send(int bytes_sent)
+{
+  if (current_thread_stats != NULL)
+  {
+    increment_stats_counter(&current_thread_stats->send_calls, 1);
+    increment_stats_counter(&current_thread_stats->bytes_sent, bytes_sent > 0 ? bytes_sent : 0);
+  }
+}
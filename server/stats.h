@@ -0,0 +1,87 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "game.h"
+
+/*
+ * Log-linear histogram of nanosecond durations in the HDR style: values
+ * below 16 get a bucket each, above that every power of two is split into
+ * 16 buckets, so a percentile is off by at most 1/16. Values beyond 2^40
+ * ns land in the last bucket.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct
+{
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total_count;
+  uint64_t max_value;
+} histogram_t;
+
+typedef enum stats_histogram
+{
+  ACTION_LATENCY,
+  ACT_PLAYER_DURATION,
+  BROADCAST_DURATION,
+  ROOM_QUEUE_WAIT,
+  STATS_HISTOGRAMS_COUNT
+} stats_histogram_t;
+
+/*
+ * Counters of one worker thread. Only the owning thread writes them, with
+ * relaxed atomic stores so the snapshot writer can read them at any time.
+ */
+typedef struct thread_stats
+{
+  int worker_id;
+  histogram_t histograms[STATS_HISTOGRAMS_COUNT];
+  uint64_t actions_count;
+  uint64_t return_codes[RETURN_CODES_COUNT];
+  uint64_t send_calls;
+  uint64_t bytes_sent;
+  struct thread_stats *next;
+} thread_stats_t;
+
+/*
+ * Per-room counters, written by whichever thread is the room's actor.
+ */
+typedef struct
+{
+  histogram_t action_latency;
+  histogram_t broadcast_duration;
+  uint64_t actions_count;
+  uint64_t return_codes[RETURN_CODES_COUNT];
+} room_stats_t;
+
+extern const char *const stats_histogram_names[STATS_HISTOGRAMS_COUNT];
+
+uint64_t stats_now_ns(void);
+
+void record_histogram(histogram_t *histogram, uint64_t value);
+
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+
+void write_histogram_json(FILE *file, const char *name, const histogram_t *histogram);
+
+void write_return_codes_json(FILE *file, const uint64_t *return_codes, uint64_t actions_count);
+
+void increment_stats_counter(uint64_t *counter, uint64_t value);
+
+void register_thread_stats(int worker_id);
+
+thread_stats_t *get_thread_stats(void);
+
+thread_stats_t *get_all_thread_stats(void);
+
+void record_thread_duration(stats_histogram_t histogram, uint64_t value);
+
+void record_thread_return_code(return_code_t return_code);
+
+void record_thread_send(int bytes_sent);
+
+#endif
@@ -0,0 +1,184 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRACE_ID_THREAD_SHIFT 40
+
+typedef struct trace_ring
+{
+  trace_span_t spans[TRACE_RING_SIZE];
+  uint64_t head;
+  uint64_t tail;
+  int thread_id;
+  int has_named_thread;
+  struct trace_ring *next;
+} trace_ring_t;
+
+int trace_sample_interval;
+
+static const char *const trace_span_names[TRACE_SPAN_TYPES_COUNT] = {
+    "parse", "room_queue_wait", "validate", "act_player", "serialize", "send",
+};
+
+static __thread trace_ring_t *thread_ring;
+static __thread uint64_t thread_actions_count;
+static trace_ring_t *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static int has_written_event;
+static unsigned long long dropped_count;
+
+/*
+ * Opens the trace as a Chrome JSON array. Events are appended as they are
+ * drained and the closing bracket, which the trace viewers do not need,
+ * is only written when tracing stops, so a running server's trace can be
+ * loaded at any time.
+ */
+void start_tracing(const char *path, int sample_interval)
+{
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL)
+  {
+    perror("trace fopen failed");
+    exit(1);
+  }
+  fputc('[', trace_file);
+  fflush(trace_file);
+
+  __atomic_store_n(&trace_sample_interval, sample_interval, __ATOMIC_RELEASE);
+}
+
+/*
+ * Gives the calling thread its ring. Rings live until the process exits,
+ * so the exporter never races with a thread going away. Threads that never
+ * register record nothing.
+ */
+void register_trace_thread(int thread_id)
+{
+  if (!IS_TRACING())
+  {
+    return;
+  }
+
+  trace_ring_t *ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+  if (ring == NULL)
+  {
+    perror("trace ring calloc failed");
+    exit(1);
+  }
+  ring->thread_id = thread_id;
+
+  pthread_mutex_lock(&rings_mutex);
+  ring->next = rings;
+  __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_mutex);
+
+  thread_ring = ring;
+}
+
+/*
+ * Picks one in every trace_sample_interval actions parsed by the thread.
+ * Returns the id its spans are recorded under, or zero when the action is
+ * not traced.
+ */
+uint64_t sample_trace_id(void)
+{
+  if (thread_ring == NULL || ++thread_actions_count % trace_sample_interval != 0)
+  {
+    return 0;
+  }
+
+  return ((uint64_t)(thread_ring->thread_id + 1) << TRACE_ID_THREAD_SHIFT) | thread_actions_count;
+}
+
+void record_trace_span(uint64_t trace_id, trace_span_type_t span_type, uint64_t started_at, int room_id,
+                       int player_id)
+{
+  trace_ring_t *ring = thread_ring;
+
+  if (ring == NULL || ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+  {
+    __atomic_fetch_add(&dropped_count, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  trace_span_t *span = &ring->spans[ring->tail % TRACE_RING_SIZE];
+  span->trace_id = trace_id;
+  span->started_at = started_at;
+  span->ended_at = stats_now_ns();
+  span->span_type = span_type;
+  span->room_id = room_id;
+  span->player_id = player_id;
+
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void write_trace_event_separator(void)
+{
+  fputs(has_written_event ? ",\n" : "\n", trace_file);
+  has_written_event = 1;
+}
+
+static void write_trace_span(trace_ring_t *ring, trace_span_t *span)
+{
+  write_trace_event_separator();
+  fprintf(trace_file,
+          "{\"name\":\"%s\",\"cat\":\"action\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"trace_id\":%llu,\"room_id\":%d,\"player_id\":%d}}",
+          trace_span_names[span->span_type], span->started_at / 1000.0,
+          (span->ended_at - span->started_at) / 1000.0, ring->thread_id, (unsigned long long)span->trace_id,
+          span->room_id, span->player_id);
+}
+
+/*
+ * Appends every span recorded so far to the trace. Only ever called by one
+ * thread at a time.
+ */
+void write_trace_spans(void)
+{
+  if (trace_file == NULL)
+  {
+    return;
+  }
+
+  for (trace_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+  {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (!ring->has_named_thread)
+    {
+      write_trace_event_separator();
+      fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+              ring->thread_id, ring->thread_id);
+      ring->has_named_thread = 1;
+    }
+    for (; head != tail; head++)
+    {
+      write_trace_span(ring, &ring->spans[head % TRACE_RING_SIZE]);
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+
+  unsigned long long drops = __atomic_exchange_n(&dropped_count, 0, __ATOMIC_RELAXED);
+  if (drops > 0)
+  {
+    fprintf(stderr, "Dropped %llu trace spans\n", drops);
+  }
+  fflush(trace_file);
+}
+
+void stop_tracing(void)
+{
+  if (trace_file == NULL)
+  {
+    return;
+  }
+
+  __atomic_store_n(&trace_sample_interval, 0, __ATOMIC_RELEASE);
+  write_trace_spans();
+  fputs("\n]\n", trace_file);
+  fclose(trace_file);
+  trace_file = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "stats.h"
+
+#define TRACE_RING_SIZE 4096
+#define DEFAULT_TRACE_SAMPLE_INTERVAL 1
+
+/*
+ * Stages of an action that are recorded as spans. The queue wait stands
+ * for the lock a room no longer takes: it is the time the action waited
+ * for the room's actor.
+ */
+typedef enum trace_span_type
+{
+  TRACE_PARSE,
+  TRACE_QUEUE_WAIT,
+  TRACE_VALIDATE,
+  TRACE_ACT_PLAYER,
+  TRACE_SERIALIZE,
+  TRACE_SEND,
+  TRACE_SPAN_TYPES_COUNT
+} trace_span_type_t;
+
+/*
+ * One span of a sampled action. Every registered thread appends spans to
+ * its own single-producer ring, which the thread exporting the trace
+ * drains. When a ring is full the span is counted and dropped.
+ */
+typedef struct
+{
+  uint64_t trace_id;
+  uint64_t started_at;
+  uint64_t ended_at;
+  int span_type;
+  int room_id;
+  int player_id;
+} trace_span_t;
+
+/*
+ * Zero while tracing is off, in which case the only cost left on the
+ * action path is the check of this value when a request is parsed.
+ */
+extern int trace_sample_interval;
+
+void start_tracing(const char *path, int sample_interval);
+
+void register_trace_thread(int thread_id);
+
+uint64_t sample_trace_id(void);
+
+void record_trace_span(uint64_t trace_id, trace_span_type_t span_type, uint64_t started_at, int room_id,
+                       int player_id);
+
+void write_trace_spans(void);
+
+void stop_tracing(void);
+
+#define IS_TRACING() (__builtin_expect(trace_sample_interval != 0, 0))
+
+/*
+ * Reads the clock only for sampled actions, whose trace id is not zero.
+ */
+#define TRACE_CLOCK(trace_id) ((trace_id) != 0 ? stats_now_ns() : 0)
+
+#define TRACE_SPAN(trace_id, span_type, started_at, room_id, player_id)     \
+  do                                                                      \
+  {                                                                       \
+    if ((trace_id) != 0)                                                  \
+    {                                                                     \
+      record_trace_span((trace_id), (span_type), (started_at), (room_id), \
+                        (player_id));                                     \
+    }                                                                     \
+  } while (0)
+
+#endif